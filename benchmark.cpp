@@ -0,0 +1,600 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <cstring>
+#include <filesystem>
+#include <unistd.h>
+#include "nn.h"
+using namespace std;
+
+constexpr auto ROWS = 4096;
+constexpr auto BATCH = 64;
+constexpr auto STEPS = 200;
+constexpr auto LR = 0.001;
+
+nn::Var build_mlp(nn::Var& x, nn::Var& y) {
+	auto net = nn::Sequential();
+	net.add_layer(nn::Linear(1, 5));
+	net.add_layer(nn::ReLU());
+	net.add_layer(nn::Linear(5, 5));
+	net.add_layer(nn::ReLU());
+	net.add_layer(nn::Linear(5, 1));
+	auto y_ = net(x);
+	return nn::MSE_Loss(y_, y);
+}
+
+double seconds_since(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+//Samples per second of Hogwild against synchronous data parallelism.
+void bench_hogwild(const nn::Matrix& x, const nn::Matrix& y) {
+	cout << "threads\thogwild(samples/s)\tdata_parallel(samples/s)" << endl;
+	for (size_t threads : { 1, 2, 4, 8 }) {
+		nn::Hogwild hog(threads, build_mlp);
+		auto start = chrono::steady_clock::now();
+		hog.train(x, y, BATCH, STEPS, LR);
+		auto hog_rate = double(threads * BATCH * STEPS) / seconds_since(start);
+
+		//The same number of samples, as one synchronous batch per step.
+		nn::DataParallel dp(threads, build_mlp);
+		nn::Matrix bx(threads * BATCH, 1), by(threads * BATCH, 1);
+		for (size_t i = 0; i < threads * BATCH; ++i)
+			bx[i] = x.data[i % x.shape.first], by[i] = y.data[i % y.shape.first];
+		start = chrono::steady_clock::now();
+		for (int i = 0; i < STEPS; ++i)
+			dp.step(bx, by, nn::Var::SGD, LR);
+		auto dp_rate = double(threads * BATCH * STEPS) / seconds_since(start);
+
+		cout << threads << "\t" << hog_rate << "\t" << dp_rate << endl;
+	}
+}
+
+nn::Matrix random_matrix(size_t m, size_t n, unsigned seed) {
+	mt19937 e(seed);
+	uniform_real_distribution<> u(-1.0, 1.0);
+	nn::Matrix ans(m, n);
+	for (auto& p : ans.data)
+		for (auto& q : p)
+			q = u(e);
+	return ans;
+}
+
+//Max and RMS error of the int8 output against the fp64 one.
+void report_error(const string& name, const nn::Matrix& ref, const nn::Matrix& out) {
+	double max_err = 0.0, err = 0.0, norm = 0.0;
+	for (size_t i = 0; i < ref.shape.first; ++i)
+		for (size_t j = 0; j < ref.shape.second; ++j) {
+			auto d = out.data[i][j] - ref.data[i][j];
+			max_err = max(max_err, abs(d));
+			err += d * d;
+			norm += ref.data[i][j] * ref.data[i][j];
+		}
+	cout << name << "\tmax_err:" << max_err << "\trms_err:" << sqrt(err / (ref.shape.first * ref.shape.second))
+		<< "\trelative:" << sqrt(err / norm) << endl;
+}
+
+//Accuracy and speed of int8 inference against fp64.
+void bench_quantization() {
+	constexpr auto IN = 32, HIDDEN = 64, OUT = 8, ROWS = 256, REPEAT = 20;
+	auto net = nn::Sequential();
+	net.add_layer(nn::Linear(IN, HIDDEN));
+	net.add_layer(nn::ReLU());
+	net.add_layer(nn::Linear(HIDDEN, HIDDEN));
+	net.add_layer(nn::TanH());
+	net.add_layer(nn::Linear(HIDDEN, OUT));
+	nn::Var x(ROWS, IN);
+	auto y = net(x);
+	auto data = random_matrix(ROWS, IN, 1);
+	x.set_data(data);
+
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i)
+		y.calculate();
+	auto fp64_time = seconds_since(start) / REPEAT;
+	auto ref = y._data();
+
+	auto calibration = random_matrix(64, IN, 2);
+	nn::QuantizedSequential qnet(net, calibration);
+	nn::Matrix out;
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i)
+		out = qnet.forward(data);
+	auto int8_time = seconds_since(start) / REPEAT;
+
+	size_t fp64_bytes = (IN * HIDDEN + HIDDEN * HIDDEN + HIDDEN * OUT + 2 * HIDDEN + OUT) * sizeof(double);
+	report_error("mlp", ref, out);
+	cout << "mlp\tfp64:" << ROWS / fp64_time << " rows/s, " << fp64_bytes << " bytes\tint8:"
+		<< ROWS / int8_time << " rows/s, " << qnet.weight_bytes() << " bytes" << endl;
+
+	//Every Linear alone on the fp64 activations, with the range calibrated as
+	//in qnet, and the inputs that were outside of that range.
+	auto cur = data, cal = calibration;
+	size_t k = 0;
+	for (auto& p : net.layers()) {
+		if (auto layer = dynamic_cast<nn::Linear*>(p.get())) {
+			double range = 0.0;
+			for (auto& row : cal.data)
+				for (auto q : row)
+					range = max(range, abs(q));
+			size_t clipped = 0;
+			for (auto& row : cur.data)
+				for (auto q : row)
+					clipped += abs(q) > range;
+			auto& w = layer->weight().graph_data().data;
+			auto& b = layer->bias().graph_data().data;
+			auto out = nn::QuantizedLinear(*layer, range).forward(cur);
+			for (auto m : { &cur, &cal }) {
+				*m = m->matmul(w);
+				for (auto& row : m->data)
+					for (size_t j = 0; j < row.size(); ++j)
+						row[j] += b.data[0][j];
+			}
+			cout << "  linear " << k++ << "\trange:" << range << "\tclipped inputs:" << clipped << "/"
+				<< cur.shape.first * w.shape.first << "\t";
+			report_error("error", cur, out);
+		}
+		else if (dynamic_cast<nn::ReLU*>(p.get()))
+			cur = cur.relu(), cal = cal.relu();
+		else
+			for (auto m : { &cur, &cal })
+				for (auto& row : m->data)
+					for (auto& q : row)
+						q = tanh(q);
+	}
+
+	//A few steps of an LSTM.
+	constexpr auto STEPS = 10;
+	nn::LSTM lstm(IN, HIDDEN);
+	nn::Var xt(ROWS, IN);
+	auto h = lstm(xt);
+	lstm.init(ROWS);
+	nn::QuantizedLSTM qlstm(lstm, 1.0);
+	for (int t = 0; t < STEPS; ++t) {
+		auto input = random_matrix(ROWS, IN, 10 + t);
+		xt.set_data(input);
+		h.calculate();
+		lstm.cycle();
+		auto qh = qlstm.forward(input);
+		if (t + 1 == STEPS)
+			report_error("lstm", h._data(), qh);
+	}
+}
+
+//Loopback test of the batching server: every client sends one row at a time.
+//Batching only pays off when a forward of many rows is much cheaper than the
+//same rows one by one, as for the large model, whose weights do not fit in
+//the cache and are read once per batch instead of once per row.
+void bench_batching(size_t in, size_t hidden, size_t layers, size_t requests) {
+	constexpr auto CLIENTS = 16;
+	auto net = nn::Sequential();
+	for (size_t i = 0; i < layers; ++i) {
+		net.add_layer(nn::Linear(i ? hidden : in, hidden));
+		net.add_layer(nn::ReLU());
+	}
+	net.add_layer(nn::Linear(hidden, 1));
+	nn::Var x(1, in);
+	auto y = net(x);
+	auto model = make_shared<const nn::InferenceModel>(y, x);
+	auto data = random_matrix(requests, in, 3);
+	cout << in << " inputs, " << layers << " x " << hidden << " hidden, " << CLIENTS << " clients, "
+		<< thread::hardware_concurrency() << " cores" << endl;
+
+	//One row per forward.
+	nn::InferenceContext ctx;
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < requests; ++i)
+		model->forward(nn::Matrix({ data.data[i] }), ctx);
+	cout << "unbatched: " << requests / seconds_since(start) << " requests/s" << endl;
+
+	nn::BatchingServer server(model, CLIENTS, 200.0);
+	vector<thread> clients;
+	start = chrono::steady_clock::now();
+	for (size_t c = 0; c < CLIENTS; ++c)
+		clients.emplace_back([&, c] {
+			for (size_t i = 0; i < requests; ++i)
+				server.submit(data.data[(c + i) % requests]).get();
+		});
+	for (auto& p : clients)
+		p.join();
+	cout << "batched: " << CLIENTS * requests / seconds_since(start) << " requests/s" << endl;
+	server.print_stats();
+}
+
+//One fused loop against a temporary matrix per operator.
+void bench_expression() {
+	constexpr auto N = 512, REPEAT = 20;
+	auto a = random_matrix(N, N, 4), b = random_matrix(N, N, 5);
+	nn::Matrix c;
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i)
+		c = (a - b) * (a - b) + a.relu();
+	auto eager = seconds_since(start) / REPEAT;
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i)
+		c = (nn::lazy(a) - nn::lazy(b)) * (nn::lazy(a) - nn::lazy(b)) + relu(nn::lazy(a));
+	auto fused = seconds_since(start) / REPEAT;
+	cout << "(a-b)*(a-b)+relu(a)\teager:" << eager * 1e3 << "ms\tfused:" << fused * 1e3 << "ms" << endl;
+}
+
+//Forward and backward of an elementwise loss, before and after optimize_graph.
+void bench_fusion() {
+	constexpr auto N = 512, REPEAT = 10;
+	nn::Var a(random_matrix(N, N, 6)), b(random_matrix(N, N, 7));
+	a.requires_optim = b.requires_optim = true;
+	auto e = ((a - b).tanh() * (a - b).sigmoid() + a.relu()).abs();
+	auto loss = e.mean();
+	auto step = [&] {
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < REPEAT; ++i) {
+			loss.calculate();
+			loss.zero_grad();
+			loss.backward();
+		}
+		return seconds_since(start) / REPEAT;
+	};
+	auto plain = step();
+	auto removed = nn::optimize_graph(loss);
+	auto fused = step();
+	cout << "graph fusion (" << removed << " nodes removed)\tplain:" << plain * 1e3 << "ms\tfused:" << fused * 1e3 << "ms" << endl;
+}
+
+//SGD steps of a Linear on one-hot style input, dense against CSR.
+void bench_sparse() {
+	constexpr auto WIDTH = 50000, OUT = 16, NNZ = 10, REPEAT = 5;
+	mt19937 e(8);
+	nn::SparseMatrix xs(WIDTH);
+	for (int i = 0; i < BATCH; ++i) {
+		vector<pair<size_t, double>> row;
+		for (int k = 0; k < NNZ; ++k)
+			row.push_back({ e() % WIDTH, 1.0 });
+		xs.add_row(row);
+	}
+	auto label = random_matrix(BATCH, OUT, 9);
+
+	double times[2];
+	for (int sparse = 0; sparse < 2; ++sparse) {
+		nn::Linear layer(WIDTH, OUT);
+		nn::Var x = sparse ? nn::Var(xs) : nn::Var(xs.dense()), y(label);
+		auto y_ = layer(x);
+		auto loss = nn::MSE_Loss(y_, y);
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < REPEAT; ++i) {
+			loss.calculate();
+			loss.zero_grad();
+			loss.backward();
+			loss.optim(nn::Var::SGD, LR);
+		}
+		times[sparse] = seconds_since(start) / REPEAT;
+	}
+	cout << "sparse input (" << WIDTH << " wide, " << NNZ << " nonzeros/row)\tdense:" << BATCH / times[0]
+		<< " samples/s\tcsr:" << BATCH / times[1] << " samples/s" << endl;
+}
+
+//Adam steps of an Embedding against a one-hot input times a dense Linear.
+void bench_embedding() {
+	constexpr auto VOCAB = 20000, DIM = 16, REPEAT = 5;
+	mt19937 e(10);
+	nn::Matrix indices(BATCH, 1), onehot(BATCH, VOCAB);
+	for (int i = 0; i < BATCH; ++i) {
+		indices[i][0] = e() % VOCAB;
+		onehot[i][size_t(indices[i][0])] = 1.0;
+	}
+	auto label = random_matrix(BATCH, DIM, 11);
+
+	double times[2];
+	for (int embedding = 0; embedding < 2; ++embedding) {
+		nn::Embedding table(VOCAB, DIM);
+		nn::Linear layer(VOCAB, DIM, false);
+		nn::Var x = embedding ? nn::Var(indices) : nn::Var(onehot), y(label);
+		auto y_ = embedding ? table(x) : layer(x);
+		auto loss = nn::MSE_Loss(y_, y);
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < REPEAT; ++i) {
+			loss.calculate();
+			loss.zero_grad();
+			loss.backward();
+			loss.optim(nn::Var::Adam, LR);
+		}
+		times[embedding] = seconds_since(start) / REPEAT;
+	}
+	cout << "embedding (" << VOCAB << " x " << DIM << ", Adam)\tone-hot linear:" << BATCH / times[0]
+		<< " samples/s\tembedding:" << BATCH / times[1] << " samples/s" << endl;
+}
+
+//Forward and backward of a 3x3 Conv2d lowered to im2col and matmul.
+void bench_conv() {
+	constexpr auto C = 8, OUT_C = 16, SIZE = 32, REPEAT = 5;
+	nn::Conv2d conv(C, OUT_C, SIZE, SIZE, 3, 1, 1);
+	nn::Var x(random_matrix(BATCH, C * SIZE * SIZE, 12));
+	auto loss = conv(x).mean();
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i) {
+		loss.calculate();
+		loss.zero_grad();
+		loss.backward();
+	}
+	auto t = seconds_since(start) / REPEAT;
+	//The forward and the two grads are one matmul each.
+	double flops = 3.0 * 2.0 * BATCH * SIZE * SIZE * (C * 9 + 1) * OUT_C;
+	cout << "conv2d (" << C << "->" << OUT_C << ", " << SIZE << "x" << SIZE << ", 3x3)\t" << BATCH / t
+		<< " images/s\t" << flops / t * 1e-9 << " GFLOP/s" << endl;
+}
+
+//Building the graph of an RNN again for every sequence.
+void bench_graph_build() {
+	constexpr auto STEPS = 100, IN = 64, HIDDEN = 64, REPEAT = 20;
+	nn::RNN rnn(IN, HIDDEN);
+	std::vector<nn::Matrix> data;
+	for (int t = 0; t < STEPS; ++t)
+		data.push_back(random_matrix(BATCH, IN, 13 + t));
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i) {
+		std::vector<nn::Var> x(data.begin(), data.end());
+		rnn.init(BATCH);
+		auto y = rnn(x);
+	}
+	auto t = seconds_since(start) / REPEAT;
+	cout << "rnn graph build (" << STEPS << " steps)\t" << t * 1e6 << "us\t" << t * 1e9 / (STEPS * 6) << "ns/node" << endl;
+}
+
+//Latency of one sample through the 1-5-5-1 network of the sample.
+void bench_static_mlp() {
+	constexpr auto REPEAT = 100000;
+	auto net = nn::Sequential();
+	net.add_layer(nn::Linear(1, 5));
+	net.add_layer(nn::ReLU());
+	net.add_layer(nn::Linear(5, 5));
+	net.add_layer(nn::ReLU());
+	net.add_layer(nn::Linear(5, 1));
+	nn::Var x(1, 1);
+	auto y = net(x);
+	nn::InferenceModel model(y, x);
+	nn::InferenceContext ctx;
+	nn::StaticSequential<nn::StaticLinear<1, 5>, nn::StaticReLU, nn::StaticLinear<5, 5>, nn::StaticReLU, nn::StaticLinear<5, 1>> fast(net);
+
+	//The sum keeps the results alive.
+	double sum = 0.0;
+	nn::Matrix in(1, 1);
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i) {
+		in.data[0][0] = i * 1e-5;
+		sum += model.forward(in, ctx).data[0][0];
+	}
+	auto dynamic = seconds_since(start) / REPEAT;
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i)
+		sum -= fast.forward({ i * 1e-5 })[0];
+	auto fixed = seconds_since(start) / REPEAT;
+	cout << "1-5-5-1 single sample	inference_model:" << dynamic * 1e9 << "ns	static:" << fixed * 1e9 << "ns	diff:" << sum << endl;
+}
+
+//One step on the full batch against micro-batches with accumulated grads.
+void bench_accumulation(const nn::Matrix& x, const nn::Matrix& y) {
+	constexpr auto MICRO = 256, REPEAT = 5;
+	nn::Var bx, by;
+	auto loss = build_mlp(bx, by);
+	bx.set_data(x);
+	by.set_data(y);
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i) {
+		loss.calculate();
+		loss.zero_grad();
+		loss.backward();
+		loss.optim(nn::Var::SGD, LR);
+	}
+	auto full = seconds_since(start) / REPEAT;
+
+	nn::GradientAccumulator acc(MICRO, build_mlp);
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i)
+		acc.step(x, y, nn::Var::SGD, LR);
+	auto micro = seconds_since(start) / REPEAT;
+	cout << "batch " << x.shape.first << "	full:" << full * 1e3 << "ms	micro-batches of " << MICRO << ":" << micro * 1e3
+		<< "ms	activation rows:" << x.shape.first << " -> " << MICRO << endl;
+}
+
+//Steps of a deep MLP in micro-batches, on one thread against one thread per stage.
+void bench_pipeline() {
+	constexpr auto WIDTH = 128, LAYERS = 8, ROWS = 1024, MICRO = 64, REPEAT = 3;
+	auto make_net = [] {
+		auto net = nn::Sequential();
+		for (int i = 0; i < LAYERS; ++i) {
+			net.add_layer(nn::Linear(i ? WIDTH : 1, i + 1 < LAYERS ? WIDTH : 1));
+			if (i + 1 < LAYERS)
+				net.add_layer(nn::TanH());
+		}
+		return net;
+	};
+	auto x = random_matrix(ROWS, 1, 14), y = random_matrix(ROWS, 1, 15);
+
+	auto net = make_net();
+	nn::GradientAccumulator acc(MICRO, [&](nn::Var& bx, nn::Var& by) {
+		auto y_ = net(bx);
+		return nn::MSE_Loss(y_, by);
+	});
+	acc.step(x, y);
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i)
+		acc.step(x, y);
+	auto serial = seconds_since(start) / REPEAT;
+
+	//Every stage holds two Linear layers.
+	auto piped_net = make_net();
+	nn::Pipeline pipe(piped_net, { 4, 4, 4, 3 }, MICRO, nn::MSE_Loss);
+	pipe.step(x, y);
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i)
+		pipe.step(x, y);
+	auto piped = seconds_since(start) / REPEAT;
+	cout << LAYERS << " layers, " << pipe.size() << " stages	serial:" << serial * 1e3 << "ms	pipeline:" << piped * 1e3 << "ms" << endl;
+}
+
+//A sweep over learning rates, end to end: the data is written to temporary
+//files, mapped back and shared by all the trials.
+void bench_sweep() {
+	constexpr auto IN = 8, TRAIN = 2048, VALID = 512, FIRST_STEPS = 20, ROUNDS = 4;
+	auto x = random_matrix(TRAIN + VALID, IN, 16);
+	nn::Matrix y(TRAIN + VALID, 1);
+	for (size_t i = 0; i < TRAIN + VALID; ++i)
+		for (size_t j = 0; j < IN; ++j)
+			y.data[i][0] += sin(3.0 * x.data[i][j]) / IN;
+	auto prefix = (filesystem::temp_directory_path() / ("myNN_sweep_" + to_string(getpid()))).string();
+	nn::MappedDataset::save(prefix + "_train.bin", nn::Matrix(x.rows(0, TRAIN)), nn::Matrix(y.rows(0, TRAIN)));
+	nn::MappedDataset::save(prefix + "_valid.bin", nn::Matrix(x.rows(TRAIN, TRAIN + VALID)), nn::Matrix(y.rows(TRAIN, TRAIN + VALID)));
+
+	{
+		nn::MappedDataset train(prefix + "_train.bin"), valid(prefix + "_valid.bin");
+		vector<nn::Trial> trials;
+		for (double lr : { 0.3, 0.1, 0.03, 0.01, 0.003, 0.001, 0.0003, 0.0001 })
+			trials.push_back({ "lr=" + to_string(lr), [](nn::Var& bx, nn::Var& by) {
+				auto net = nn::Sequential();
+				net.add_layer(nn::Linear(IN, 32));
+				net.add_layer(nn::BatchNorm1d(32));
+				net.add_layer(nn::ReLU());
+				net.add_layer(nn::Linear(32, 1));
+				auto y_ = net(bx);
+				return nn::MSE_Loss(y_, by);
+			}, nn::Var::Adam, lr });
+		nn::Sweep sweep(train, valid);
+		auto start = chrono::steady_clock::now();
+		auto results = sweep.run(trials, FIRST_STEPS, ROUNDS);
+		auto time = seconds_since(start);
+		auto best = *max_element(results.begin(), results.end(), [](const nn::Sweep::Result& a, const nn::Sweep::Result& b) {
+			return a.rounds < b.rounds;
+		});
+		cout << "sweep of " << trials.size() << " trials, " << ROUNDS << " rounds\ttime:" << time * 1e3 << "ms\tbest:" << best.name
+			<< "\tsteps:" << best.steps << "\tvalid_loss:" << best.valid_loss << endl;
+	}
+	remove((prefix + "_train.bin").c_str());
+	remove((prefix + "_valid.bin").c_str());
+}
+
+//Filling a large weight from Philox streams against one default_random_engine.
+void bench_init() {
+	constexpr auto N = 2048;
+	nn::Matrix w(N, N);
+	auto start = chrono::steady_clock::now();
+	default_random_engine e;
+	uniform_real_distribution<> u(-1.0, 1.0);
+	for (auto& row : w.data)
+		for (auto& q : row)
+			q = u(e);
+	auto serial = seconds_since(start);
+	start = chrono::steady_clock::now();
+	nn::init_weights(w, nn::Init::uniform);
+	auto uniform = seconds_since(start);
+	start = chrono::steady_clock::now();
+	nn::init_weights(w, nn::Init::he_normal);
+	auto normal = seconds_since(start);
+	cout << N << "x" << N << " init	default_random_engine:" << serial * 1e3 << "ms	philox uniform:" << uniform * 1e3
+		<< "ms	philox he_normal:" << normal * 1e3 << "ms" << endl;
+}
+
+//Dropout with a packed mask against multiplying by a mask of doubles.
+void bench_dropout() {
+	constexpr auto N = 1024, REPEAT = 10;
+	nn::Var x(random_matrix(N, N, 16));
+	auto kernel = make_shared<nn::DropoutKernel>();
+	auto y = x.dropout(kernel);
+	auto loss = y.mean();
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i) {
+		loss.calculate();
+		loss.zero_grad();
+		loss.backward();
+	}
+	auto packed = seconds_since(start) / REPEAT;
+	auto mask_bytes = y.graph_data().dropout_mask.size() * sizeof(uint64_t);
+
+	//The mask is drawn again every step, as dropout does.
+	nn::Var x2(random_matrix(N, N, 16)), mask(N, N);
+	auto loss2 = (x2 * mask).mean();
+	mt19937 e(17);
+	bernoulli_distribution keep(0.5);
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < REPEAT; ++i) {
+		nn::Matrix m(N, N);
+		for (auto& row : m.data)
+			for (auto& q : row)
+				q = keep(e) ? 2.0 : 0.0;
+		mask.set_data(m);
+		loss2.calculate();
+		loss2.zero_grad();
+		loss2.backward();
+	}
+	auto dense = seconds_since(start) / REPEAT;
+	cout << "dropout " << N << "x" << N << "	packed:" << packed * 1e3 << "ms, " << mask_bytes / 1024 << "KB mask	double mask:"
+		<< dense * 1e3 << "ms, " << N * N * sizeof(double) / 1024 << "KB mask" << endl;
+}
+
+//The blocked sum against a plain loop, and its bits on pools of different sizes.
+void bench_reduction() {
+	constexpr auto N = 4096;
+	auto x = random_matrix(N, N, 18);
+	auto start = chrono::steady_clock::now();
+	double plain = 0.0;
+	for (auto& row : x.data)
+		for (auto q : row)
+			plain += q;
+	auto serial = seconds_since(start);
+	start = chrono::steady_clock::now();
+	auto blocked = nn::sum(x);
+	auto parallel = seconds_since(start);
+	//The same sum on pools of 1, 2 and 8 threads must have the same bits.
+	bool same = true;
+	for (size_t threads : { 1, 2, 8 }) {
+		nn::ThreadPool pool(threads);
+		auto s = nn::sum(x, pool);
+		same = same and memcmp(&s, &blocked, sizeof(s)) == 0;
+	}
+	cout << "sum " << N << "x" << N << "\tplain loop:" << serial * 1e3 << "ms\tnn::sum:" << parallel * 1e3 << "ms\tsame on 1, 2 and 8 threads:"
+		<< (same ? "yes" : "no") << "\tplain - nn::sum:" << plain - blocked << endl;
+}
+
+//Feeding mini-batches to a Var by copying the rows against a view of them.
+void bench_views() {
+	constexpr auto ROWS = 65536, COLS = 256, BATCH = 64;
+	auto x = random_matrix(ROWS, COLS, 19);
+	nn::Var in;
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i + BATCH <= ROWS; i += BATCH)
+		in.set_data(nn::Matrix(vector<vector<double>>(x.data.begin() + i, x.data.begin() + i + BATCH)));
+	auto copied = seconds_since(start);
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i + BATCH <= ROWS; i += BATCH)
+		in.set_data(x.rows(i, i + BATCH));
+	auto viewed = seconds_since(start);
+	cout << "batches of " << BATCH << "x" << COLS << "\tcopy rows:" << copied * 1e3 << "ms\tview:" << viewed * 1e3 << "ms" << endl;
+}
+
+int main() {
+	nn::Matrix x(ROWS, 1), y(ROWS, 1);
+	for (int i = 0; i < ROWS; ++i) {
+		x[i][0] = double(i) / ROWS;
+		y[i][0] = 3.0 * x[i][0] * x[i][0] + 2;
+	}
+
+	bench_hogwild(x, y);
+	bench_quantization();
+	bench_batching(32, 128, 1, 500);
+	bench_batching(256, 1024, 2, 20);
+	bench_expression();
+	bench_fusion();
+	bench_sparse();
+	bench_embedding();
+	bench_conv();
+	bench_graph_build();
+	bench_static_mlp();
+	bench_accumulation(x, y);
+	bench_pipeline();
+	bench_sweep();
+	bench_init();
+	bench_dropout();
+	bench_reduction();
+	bench_views();
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+#include <iostream>
+#include <string>
+#include <cmath>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "nn.h"
+using namespace std;
+
+//Forks N ranks on this machine, trains the same network on a shard of the
+//batch in each of them with distributed_backward, and checks every step
+//against one process that trains on the whole batch.
+//Usage: myNN_distributed [ranks] [tcp]
+
+constexpr auto ROWS_PER_RANK = 16;
+constexpr auto STEPS = 20;
+constexpr auto LR = 0.01;
+
+nn::Var build_mlp(nn::Var& x, nn::Var& y) {
+	auto net = nn::Sequential();
+	net.add_layer(nn::Linear(3, 8));
+	net.add_layer(nn::TanH());
+	net.add_layer(nn::Linear(8, 1));
+	auto y_ = net(x);
+	return nn::MSE_Loss(y_, y);
+}
+
+double max_diff(const nn::Matrix& a, const nn::Matrix& b) {
+	if (a.shape != b.shape)
+		return INFINITY;
+	double ans = 0.0;
+	for (size_t i = 0; i < a.shape.first; ++i)
+		for (size_t j = 0; j < a.shape.second; ++j)
+			ans = max(ans, abs(a.data[i][j] - b.data[i][j]));
+	return ans;
+}
+
+//The largest difference of the grads and the weights from the reference.
+double run_rank(size_t rank, const vector<string>& addresses) {
+	size_t world = addresses.size(), rows = world * ROWS_PER_RANK;
+	nn::Matrix x(rows, 3), y(rows, 1);
+	for (size_t i = 0; i < rows; ++i) {
+		for (size_t j = 0; j < 3; ++j)
+			x.data[i][j] = sin(double(i * 3 + j));
+		y.data[i][0] = cos(double(i));
+	}
+
+	nn::ProcessGroup group(rank, addresses);
+	nn::manual_seed(1);
+	nn::Var dx, dy;
+	auto dist = build_mlp(dx, dy);
+	dx.set_data(x.rows(rank * ROWS_PER_RANK, (rank + 1) * ROWS_PER_RANK));
+	dy.set_data(y.rows(rank * ROWS_PER_RANK, (rank + 1) * ROWS_PER_RANK));
+	nn::manual_seed(1);
+	nn::Var rx(x), ry(y);
+	auto ref = build_mlp(rx, ry);
+
+	dist.calculate();
+	nn::broadcast_parameters(dist, group);
+	auto dist_params = dist.parameters(), ref_params = ref.parameters();
+	double err = 0.0;
+	for (int s = 0; s < STEPS; ++s) {
+		dist.calculate();
+		dist.zero_grad();
+		nn::distributed_backward(dist, group);
+		ref.calculate();
+		ref.zero_grad();
+		ref.backward();
+		for (size_t p = 0; p < dist_params.size(); ++p)
+			err = max(err, max_diff(dist_params[p]->grad, ref_params[p]->grad));
+		dist.optim(nn::Var::SGD, LR);
+		ref.optim(nn::Var::SGD, LR);
+	}
+	for (size_t p = 0; p < dist_params.size(); ++p)
+		err = max(err, max_diff(dist_params[p]->data, ref_params[p]->data));
+	return err;
+}
+
+int main(int argc, char** argv) {
+	size_t world = argc > 1 ? stoul(argv[1]) : 4;
+	bool tcp = argc > 2 and string(argv[2]) == "tcp";
+	vector<string> addresses;
+	for (size_t r = 0; r < world; ++r)
+		addresses.push_back(tcp ? "127.0.0.1:" + to_string(29500 + r)
+			: "unix:/tmp/myNN_" + to_string(getpid()) + "_" + to_string(r));
+
+	//Fork before anything starts a thread.
+	vector<pid_t> children;
+	for (size_t r = 0; r < world; ++r) {
+		auto pid = fork();
+		if (pid == 0) {
+			int code = 1;
+			try {
+				auto err = run_rank(r, addresses);
+				cout << "rank " << r << "\tmax error:" << err << endl;
+				code = err < 1e-10 ? 0 : 1;
+			}
+			catch (const char* e) {
+				cout << "rank " << r << "\t" << e << endl;
+			}
+			_exit(code);
+		}
+		if (pid < 0) {
+			cout << "fork failed" << endl;
+			return 1;
+		}
+		children.push_back(pid);
+	}
+
+	bool ok = true;
+	for (auto pid : children) {
+		int status = 0;
+		waitpid(pid, &status, 0);
+		ok = ok and WIFEXITED(status) and WEXITSTATUS(status) == 0;
+	}
+	cout << world << " ranks over " << (tcp ? "TCP" : "Unix sockets") << ": " << (ok ? "OK" : "FAILED") << endl;
+	return ok ? 0 : 1;
+}
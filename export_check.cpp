@@ -0,0 +1,119 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include "nn.h"
+#if defined(NN_EXPORTED_MODEL)
+#include "exported_model.h"
+#endif
+using namespace std;
+
+//Trains a small network and writes it with export_cpp. Built again with the
+//generated header, it checks predict() against InferenceModel and times both.
+//Usage: myNN_export <header>, then myNN_export_check
+
+constexpr auto IN = 4, HIDDEN = 16, ROWS = 64, STEPS = 50;
+constexpr auto LR = 0.01;
+
+//The same trained network every time: the seed and the data are fixed.
+nn::Sequential train_net() {
+	nn::manual_seed(1);
+	auto net = nn::Sequential();
+	net.add_layer(nn::Linear(IN, HIDDEN));
+	net.add_layer(nn::ReLU());
+	net.add_layer(nn::Dropout(0.1));
+	net.add_layer(nn::Linear(HIDDEN, HIDDEN));
+	net.add_layer(nn::TanH());
+	net.add_layer(nn::Linear(HIDDEN, 1));
+	net.add_layer(nn::Sigmoid());
+
+	nn::Matrix x(ROWS, IN), y(ROWS, 1);
+	for (size_t i = 0; i < ROWS; ++i) {
+		for (size_t j = 0; j < IN; ++j)
+			x.data[i][j] = sin(double(i * IN + j));
+		y.data[i][0] = x.data[i][0] * x.data[i][1] > 0.0 ? 1.0 : 0.0;
+	}
+	nn::Var bx(x), by(y);
+	auto pred = net(bx);
+	auto loss = nn::MSE_Loss(pred, by);
+	for (int s = 0; s < STEPS; ++s) {
+		loss.calculate();
+		loss.zero_grad();
+		loss.backward();
+		loss.optim(nn::Var::Adam, LR);
+	}
+	net.eval();
+	return net;
+}
+
+double seconds_since(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+#if !defined(NN_EXPORTED_MODEL)
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cout << "Usage: myNN_export <header>" << endl;
+		return 1;
+	}
+	auto net = train_net();
+	ofstream file(argv[1]);
+	nn::export_cpp(net, file, "exported");
+	return file ? 0 : 1;
+}
+#else
+int main() {
+	constexpr auto SAMPLES = 1000, REPEAT = 100;
+	auto net = train_net();
+	nn::Var x(1, IN);
+	auto y = net(x);
+	nn::InferenceModel model(y, x);
+	nn::InferenceContext ctx;
+
+	nn::Matrix in(1, IN);
+	double out[exported::out_features], err = 0.0;
+	for (int i = 0; i < SAMPLES; ++i) {
+		for (size_t j = 0; j < IN; ++j)
+			in.data[0][j] = cos(double(i * IN + j));
+		exported::predict(in.data[0].data(), out);
+		err = max(err, abs(out[0] - model.forward(in, ctx).data[0][0]));
+	}
+
+	//The sum keeps the results alive.
+	double sum = 0.0;
+	auto start = chrono::steady_clock::now();
+	for (int r = 0; r < REPEAT; ++r)
+		for (int i = 0; i < SAMPLES; ++i) {
+			in.data[0][0] = i * 1e-3;
+			sum += model.forward(in, ctx).data[0][0];
+		}
+	auto dynamic = seconds_since(start) / (REPEAT * SAMPLES);
+	start = chrono::steady_clock::now();
+	for (int r = 0; r < REPEAT; ++r)
+		for (int i = 0; i < SAMPLES; ++i) {
+			in.data[0][0] = i * 1e-3;
+			exported::predict(in.data[0].data(), out);
+			sum -= out[0];
+		}
+	auto fixed = seconds_since(start) / (REPEAT * SAMPLES);
+
+	//A weight that is not finite cannot be written as a C++ literal.
+	bool refused = false;
+	auto& w = dynamic_cast<nn::Linear&>(*net.layers()[0]).weight().graph_data().data;
+	w.data[0][0] = NAN;
+	try {
+		ostringstream discard;
+		nn::export_cpp(net, discard);
+	}
+	catch (const char*) {
+		refused = true;
+	}
+
+	cout << IN << "-" << HIDDEN << "-" << HIDDEN << "-1 exported\tmax error:" << err << "\tinference_model:" << dynamic * 1e9
+		<< "ns\tpredict:" << fixed * 1e9 << "ns\tdiff:" << sum << "\tnan refused:" << (refused ? "yes" : "no") << endl;
+	bool ok = err < 1e-12 and refused;
+	cout << (ok ? "OK" : "FAILED") << endl;
+	return ok ? 0 : 1;
+}
+#endif
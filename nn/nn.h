@@ -2,17 +2,49 @@
 
 #include <iostream>
 #include <vector>
+#include <array>
+#include <cassert>
 #include <memory>
 #include <unordered_set>
 #include <tuple>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <future>
+#include <exception>
+#include <chrono>
+#include <cmath>
 
 namespace nn {
+	namespace expr {
+		template<class E> struct Base;
+	}
+
 	//A simple matrix class to implement basic matrix operations.
+	class MatrixView;
+
 	class Matrix {
 	public:
 		Matrix() = default;
 		Matrix(const std::vector<std::vector<double>>&);
 		Matrix(size_t m, size_t n, double init_val = 0.0);
+		//Copy the elements of a view.
+		explicit Matrix(const MatrixView&);
+		//Copy the elements of a view and reuse the memory when the shape matches.
+		Matrix& operator=(const MatrixView&);
+		//Evaluate an elementwise expression made with lazy().
+		template<class E> Matrix(const expr::Base<E>& e);
+		template<class E> Matrix& operator=(const expr::Base<E>& e);
+		template<class E> Matrix& operator+=(const expr::Base<E>& e);
+		template<class E> Matrix& operator-=(const expr::Base<E>& e);
+		Matrix(const Matrix&) = default;
+		Matrix(Matrix&&) = default;
+		Matrix& operator=(const Matrix&) = default;
+		Matrix& operator=(Matrix&&) = default;
 		std::pair<size_t, size_t> shape;
 
 		std::vector<std::vector<double>> data;
@@ -29,20 +61,272 @@ namespace nn {
 		std::vector<double>& operator[](size_t n);
 
 		Matrix matmul(const Matrix& rhs) const;
+		//Write the product into out and reuse its memory when the shape matches.
+		//out may be one of the operands, then the product goes through a copy.
+		void matmul(const Matrix& rhs, Matrix& out) const;
 		Matrix transpose() const;
 		void print() const;
 		void clear();
 		bool empty() const;
+
+		//Views of the whole matrix, of the rows in [begin, end) and of the
+		//columns in [begin, end), with every step-th row or column.
+		MatrixView view() const;
+		MatrixView rows(size_t begin, size_t end, size_t step = 1) const;
+		MatrixView cols(size_t begin, size_t end, size_t step = 1) const;
+	};
+
+	//A read-only window of a Matrix that does not copy it. Element (i, j) is
+	//m.data[row_begin + i * row_step][col_begin + j * col_step].
+	//The matrix must outlive the view and keep its shape.
+	class MatrixView {
+		const Matrix* m = nullptr;
+		size_t row_begin = 0, col_begin = 0, row_step = 1, col_step = 1;
+	public:
+		std::pair<size_t, size_t> shape;
+
+		MatrixView() = default;
+		MatrixView(const Matrix& m);
+		MatrixView(const Matrix& m, size_t row_begin, size_t row_end, size_t col_begin, size_t col_end,
+			size_t row_step = 1, size_t col_step = 1);
+
+		double operator()(size_t i, size_t j) const { return m->data[row_begin + i * row_step][col_begin + j * col_step]; }
+		//Element j of row i is row(i)[j * step()].
+		const double* row(size_t i) const { return m->data[row_begin + i * row_step].data() + col_begin; }
+		size_t step() const { return col_step; }
+		//Views of this view, with the indices of this view.
+		MatrixView rows(size_t begin, size_t end, size_t step = 1) const;
+		MatrixView cols(size_t begin, size_t end, size_t step = 1) const;
+		void copy_to(Matrix& out) const;
+		bool empty() const;
+
+		//The product of two views, written into out as Matrix::matmul does.
+		Matrix matmul(const MatrixView& rhs) const;
+		void matmul(const MatrixView& rhs, Matrix& out) const;
+	};
+
+	//Lazy elementwise expressions of matrices.
+	//lazy(a) wraps a matrix, and + - * / with matrices or doubles, relu, abs,
+	//tanh, sigmoid and sqrt build an expression without computing anything.
+	//Assigning the expression to a Matrix evaluates the whole chain in one
+	//loop over the elements, with no temporary matrices:
+	//	Matrix d = sqrt(lazy(a) - lazy(b)) * 0.5;
+	//The expression keeps references to the matrices, so do not store it.
+	namespace expr {
+		template<class E>
+		struct Base {
+			const E& self() const { return static_cast<const E&>(*this); }
+		};
+
+		struct Leaf :Base<Leaf> {
+			const Matrix& m;
+			struct Row {
+				const double* p;
+				double operator[](size_t j) const { return p[j]; }
+			};
+			Leaf(const Matrix& m) :m(m) {}
+			bool scalar() const { return false; }
+			std::pair<size_t, size_t> shape() const { return m.shape; }
+			Row row(size_t i) const { return { m.data[i].data() }; }
+		};
+
+		struct ViewLeaf :Base<ViewLeaf> {
+			MatrixView v;
+			struct Row {
+				const double* p;
+				size_t step;
+				double operator[](size_t j) const { return p[j * step]; }
+			};
+			ViewLeaf(const MatrixView& v) :v(v) {}
+			bool scalar() const { return false; }
+			std::pair<size_t, size_t> shape() const { return v.shape; }
+			Row row(size_t i) const { return { v.row(i), v.step() }; }
+		};
+
+		struct Scalar :Base<Scalar> {
+			double v;
+			struct Row {
+				double v;
+				double operator[](size_t) const { return v; }
+			};
+			Scalar(double v) :v(v) {}
+			bool scalar() const { return true; }
+			std::pair<size_t, size_t> shape() const { return { 0, 0 }; }
+			Row row(size_t) const { return { v }; }
+		};
+
+		template<class Op, class L, class R>
+		struct Binary :Base<Binary<Op, L, R>> {
+			L l;
+			R r;
+			struct Row {
+				typename L::Row l;
+				typename R::Row r;
+				double operator[](size_t j) const { return Op::apply(l[j], r[j]); }
+			};
+			Binary(const L& l, const R& r) :l(l), r(r) {}
+			bool scalar() const { return l.scalar() and r.scalar(); }
+			std::pair<size_t, size_t> shape() const {
+				assert(l.scalar() or r.scalar() or l.shape() == r.shape());
+				return l.scalar() ? r.shape() : l.shape();
+			}
+			Row row(size_t i) const { return { l.row(i), r.row(i) }; }
+		};
+
+		template<class Op, class A>
+		struct Unary :Base<Unary<Op, A>> {
+			A a;
+			struct Row {
+				typename A::Row a;
+				double operator[](size_t j) const { return Op::apply(a[j]); }
+			};
+			Unary(const A& a) :a(a) {}
+			bool scalar() const { return a.scalar(); }
+			std::pair<size_t, size_t> shape() const { return a.shape(); }
+			Row row(size_t i) const { return { a.row(i) }; }
+		};
+
+		struct Add { static double apply(double x, double y) { return x + y; } };
+		struct Sub { static double apply(double x, double y) { return x - y; } };
+		struct Mul { static double apply(double x, double y) { return x * y; } };
+		struct Div { static double apply(double x, double y) { return x / y; } };
+		struct Relu { static double apply(double x) { return x > 0 ? x : 0; } };
+		struct Abs { static double apply(double x) { return std::abs(x); } };
+		struct Tanh { static double apply(double x) { return std::tanh(x); } };
+		struct Sigmoid { static double apply(double x) { return 1.0 / (1.0 + std::exp(-x)); } };
+		struct Sqrt { static double apply(double x) { return std::sqrt(x); } };
+
+#define NN_EXPR_BINARY(OP, NAME) \
+		template<class L, class R> \
+		Binary<NAME, L, R> operator OP(const Base<L>& l, const Base<R>& r) { return { l.self(), r.self() }; } \
+		template<class L> \
+		Binary<NAME, L, Scalar> operator OP(const Base<L>& l, double r) { return { l.self(), Scalar(r) }; } \
+		template<class R> \
+		Binary<NAME, Scalar, R> operator OP(double l, const Base<R>& r) { return { Scalar(l), r.self() }; }
+		NN_EXPR_BINARY(+, Add)
+		NN_EXPR_BINARY(-, Sub)
+		NN_EXPR_BINARY(*, Mul)
+		NN_EXPR_BINARY(/, Div)
+#undef NN_EXPR_BINARY
+
+		template<class A> Unary<Relu, A> relu(const Base<A>& a) { return { a.self() }; }
+		template<class A> Unary<Abs, A> abs(const Base<A>& a) { return { a.self() }; }
+		template<class A> Unary<Tanh, A> tanh(const Base<A>& a) { return { a.self() }; }
+		template<class A> Unary<Sigmoid, A> sigmoid(const Base<A>& a) { return { a.self() }; }
+		template<class A> Unary<Sqrt, A> sqrt(const Base<A>& a) { return { a.self() }; }
+		template<class A> Binary<Mul, Scalar, A> operator-(const Base<A>& a) { return { Scalar(-1.0), a.self() }; }
+	}
+
+	inline expr::Leaf lazy(const Matrix& m) {
+		return expr::Leaf(m);
+	}
+
+	inline expr::ViewLeaf lazy(const MatrixView& v) {
+		return expr::ViewLeaf(v);
+	}
+
+	template<class E>
+	Matrix::Matrix(const expr::Base<E>& e) {
+		*this = e;
+	}
+
+	template<class E>
+	Matrix& Matrix::operator=(const expr::Base<E>& e) {
+		//Every element only reads the same element of the inputs, so the
+		//expression may use this matrix too.
+		auto& ex = e.self();
+		auto s = ex.shape();
+		if (shape != s or data.size() != s.first) {
+			data.assign(s.first, std::vector<double>(s.second));
+			shape = s;
+		}
+		for (size_t i = 0; i < s.first; ++i) {
+			auto row = ex.row(i);
+			auto out = data[i].data();
+			for (size_t j = 0; j < s.second; ++j)
+				out[j] = row[j];
+		}
+		return *this;
+	}
+
+	template<class E>
+	Matrix& Matrix::operator+=(const expr::Base<E>& e) {
+		return *this = lazy(*this) + e;
+	}
+
+	template<class E>
+	Matrix& Matrix::operator-=(const expr::Base<E>& e) {
+		return *this = lazy(*this) - e;
+	}
+
+	//A sparse matrix in compressed sparse row (CSR) form, for wide inputs
+	//such as one-hot or bag-of-words features.
+	class SparseMatrix {
+	public:
+		std::pair<size_t, size_t> shape;
+		//The entries of row i are col[k] and val[k] for k in [row_ptr[i], row_ptr[i + 1]).
+		std::vector<size_t> row_ptr{ 0 }, col;
+		std::vector<double> val;
+
+		SparseMatrix() = default;
+		//An empty matrix with n_cols columns. Add the rows with add_row().
+		explicit SparseMatrix(size_t n_cols);
+		//Keep the nonzeros of a dense matrix.
+		SparseMatrix(const Matrix&);
+
+		//Append a row given as (column, value) pairs.
+		void add_row(const std::vector<std::pair<size_t, double>>& entries);
+		size_t nnz() const;
+		Matrix dense() const;
+
+		//The time of both is in proportion to nnz() * rhs.shape.second.
+		Matrix matmul(const Matrix& rhs) const;
+		void matmul(const Matrix& rhs, Matrix& out) const;
+		//Add transpose() * rhs into out, and append the rows of out that change to rows.
+		void add_transpose_matmul(const Matrix& rhs, Matrix& out, std::vector<size_t>& rows) const;
 	};
 
+	struct FusedKernel;
+	struct ConvKernel;
+	struct NormKernel;
+	struct DropoutKernel;
+
+	//-------------------Initialization---------------------
+	//Philox4x32-10, a counter-based generator. The numbers of a counter only
+	//depend on the seed, the stream and the counter, so every tensor gets its
+	//own stream and any part of it can be made by any thread.
+	class Philox {
+		uint64_t seed, stream;
+	public:
+		Philox(uint64_t seed, uint64_t stream);
+		//A new stream of the seed set by manual_seed().
+		static Philox next();
+		//Four random 32-bit numbers, the same for the same counter.
+		std::array<uint32_t, 4> operator()(uint64_t counter) const;
+		//The numbers of n counters from counter, four by four into out.
+		void operator()(uint64_t counter, size_t n, uint32_t* out) const;
+		//A double in [0, 1) made from two of the numbers.
+		static double uniform(uint32_t hi, uint32_t lo);
+	};
+
+	//The seed of the weights made afterwards. The streams start again from the first one,
+	//so the same program makes the same weights after the same seed.
+	void manual_seed(uint64_t seed);
+
+	//Xavier and He take the fan in from the rows of the weight and the fan out
+	//from its columns, as in Linear and the convolutions.
+	enum class Init { uniform, normal, xavier_uniform, xavier_normal, he_uniform, he_normal };
+
 	//A Var class that includes some basic NN functions.
 	class Var {
 	public:
-		enum Var_op { none, equals, plus, minus, times, devides, mm, re, th, ab, sig, from_double, ones_like, ones_vector, means_op };
+		enum Var_op { none, equals, plus, minus, times, devides, mm, re, th, ab, sig, from_double, ones_like, ones_vector, means_op, fused, emb, conv_op, max_pool_op, avg_pool_op, softmax_ce, norm_op, dropout_op };
 		enum Optim { SGD, Adam };
 		//Adam Optimizer Parameters.
 		Matrix adam_m, adam_v;
 		int adam_t = 0;
+		//The Adam step of every row, for the lazy updates of sparse grads.
+		std::vector<int> adam_row_t;
 
 		//Graph_ptr is a pointer that points to the real Var on the calculation graph.
 		std::shared_ptr<Var> num1 = nullptr, num2 = nullptr, graph_ptr = nullptr;
@@ -50,9 +334,27 @@ namespace nn {
 		Var_op op = Var_op::none;
 		bool requires_grad = true, requires_optim = false;
 		double op_num = 0.0;
+		//The inputs and the program of a fused node.
+		std::vector<std::shared_ptr<Var>> inputs;
+		std::shared_ptr<const FusedKernel> kernel;
+		//The shape of a convolution or pooling node.
+		std::shared_ptr<const ConvKernel> conv_kernel;
+		//The state of a normalization node.
+		std::shared_ptr<NormKernel> norm_kernel;
+		//The state of a dropout node, and the elements its last forward kept, one bit each.
+		std::shared_ptr<DropoutKernel> dropout_kernel;
+		std::vector<uint64_t> dropout_mask;
+		//The data of a sparse input. Then data only keeps the shape.
+		std::shared_ptr<const SparseMatrix> sparse;
+		//Unless grad_dense is set, the grad is zero out of grad_rows, so
+		//zero_grad() and SGD only go over these rows.
+		std::vector<size_t> grad_rows;
+		bool grad_dense = false;
 
 		Var() = default;
 		Var(const Matrix& matrix) :data(matrix) {}
+		//A sparse input. It can only be the left side of matmul() and does not require grad.
+		Var(const SparseMatrix& matrix);
 		Var(Var&& rhs);
 		Var(const Var&) = default;
 		Var(const std::vector<std::vector<double>>& v) :data(v) {}
@@ -63,13 +365,24 @@ namespace nn {
 		void print() const;
 		Var graph() const;
 		Var& graph_data();
+		//The node of this Var on the graph. The first call copies this Var into a
+		//node from a per-thread pool.
+		const std::shared_ptr<Var>& node();
 		Matrix _data() const;
 		Matrix _grad() const;
+		//The data and grad of the node without copying them. They stay valid
+		//until the node is calculated again or its data is set. Sparse data
+		//has no view.
+		MatrixView data_view() const;
+		MatrixView grad_view() const;
 		std::vector<double>& operator[](size_t n);
 		bool empty() const;
 		Var copy();
 		void set_data(const Matrix&);
 		void set_data(const Var&);
+		void set_data(const SparseMatrix&);
+		//Copy the view into the node, reusing its memory when the shape matches.
+		void set_data(const MatrixView&);
 
 		Var operator=(Var& rhs);
 		Var operator=(Var&& rhs);
@@ -88,11 +401,34 @@ namespace nn {
 		Var sigmoid();
 		Var mean();
 		Var abs();
+		//Look up the rows of this table. Every row of indices holds L row
+		//numbers, and the L rows are put side by side in the result.
+		//The grad of the table is sparse.
+		Var embed(Var& indices);
+		Var embed(Var&& indices);
+		//Convolution and pooling of images stored one per row, see ConvKernel.
+		Var conv(Var& weight, const std::shared_ptr<const ConvKernel>& kernel);
+		Var max_pool(const std::shared_ptr<const ConvKernel>& kernel);
+		Var avg_pool(const std::shared_ptr<const ConvKernel>& kernel);
+		//Batch or layer normalization, see NormKernel.
+		Var norm(Var& param, const std::shared_ptr<NormKernel>& kernel);
+		Var dropout(const std::shared_ptr<DropoutKernel>& kernel);
 
 		void calculate();
 		void zero_grad();
 		void backward();
+		//on_grad_ready is called for every node to be optimized as soon as its grad is complete.
+		void backward(const std::function<void(Var*)>& on_grad_ready);
+		//Backward pass that starts from grad_output instead of ones, for a graph whose output feeds another graph.
+		void backward(const Matrix& grad_output, const std::function<void(Var*)>& on_grad_ready = nullptr);
 		void optim(Optim func = SGD, double LR = 0.001);
+		//Calculate the result of op from its inputs a and b into out.
+		static void forward_kernel(Var_op op, double op_num, const Matrix* a, const Matrix* b, Matrix& out);
+		//The nodes that will be updated by optim(), in a fixed DFS order.
+		std::vector<Var*> parameters();
+		//Switch the BatchNorm1d and Dropout nodes of the graph to training or
+		//evaluation mode, for code that only holds the output of a model.
+		void train(bool mode = true);
 	protected:
 		void cal(std::unordered_set<Var*>&);
 		void _backward();
@@ -100,6 +436,104 @@ namespace nn {
 		void Adam_optim(double, double, double, std::unordered_set<Var*>&);
 	};
 
+	//Switches the graph of output to training or evaluation mode like
+	//Var::train(), and puts every BatchNorm1d and Dropout node back in the
+	//mode it had when the guard is destroyed, also when an exception is thrown.
+	class TrainModeGuard {
+		std::vector<std::pair<std::shared_ptr<NormKernel>, bool>> norms;
+		std::vector<std::pair<std::shared_ptr<DropoutKernel>, bool>> dropouts;
+	public:
+		TrainModeGuard(Var& output, bool mode);
+		TrainModeGuard(const TrainModeGuard&) = delete;
+		TrainModeGuard& operator=(const TrainModeGuard&) = delete;
+		~TrainModeGuard();
+	};
+
+	//The program of a fused node, made by optimize_graph().
+	//Registers 0 to n_inputs-1 hold the inputs, and instruction k writes
+	//register n_inputs+k. The last register is the result.
+	struct FusedKernel {
+		struct Instr {
+			Var::Var_op op;
+			size_t a, b;
+		};
+		size_t n_inputs = 0;
+		std::vector<Instr> code;
+
+		//Both run over one row at a time, so the registers stay in cache.
+		void forward(const std::vector<const Matrix*>& in, Matrix& out) const;
+		//Add the grads of the inputs. in_grad[k] may be null.
+		void backward(const std::vector<const Matrix*>& in, const Matrix& grad, const std::vector<Matrix*>& in_grad) const;
+	};
+
+	//The shape of a convolution or pooling node.
+	//Every row of the input is one image of channels x height x width, stored
+	//channel by channel and then row by row. The output is stored the same
+	//way, with out_h() x out_w() pixels per channel.
+	struct ConvKernel {
+		size_t channels = 1, height = 1, width = 1;
+		size_t kernel_h = 1, kernel_w = 1, stride_h = 1, stride_w = 1, pad_h = 0, pad_w = 0;
+		//The last row of the convolution weight is the bias.
+		bool bias = false;
+
+		size_t out_h() const;
+		size_t out_w() const;
+		//The number of rows of the convolution weight.
+		size_t patch_size() const;
+
+		//The convolution is lowered to im2col and one matmul per image, with the
+		//images split across the threads of ThreadPool::shared().
+		//w is patch_size() x out_channels.
+		void forward(Var::Var_op op, const Matrix& x, const Matrix* w, Matrix& out) const;
+		//Add the grads of x and w. Either may be null.
+		void backward(Var::Var_op op, const Matrix& x, const Matrix* w, const Matrix& grad, Matrix* x_grad, Matrix* w_grad) const;
+	};
+
+	//The state of a batch or layer normalization node.
+	//The parameter is 2 x features: the scale (gamma) and then the shift (beta).
+	struct NormKernel {
+		//Normalize every column over the batch, or every row over its features.
+		bool batch = true;
+		//Batch norm uses the statistics of the batch and updates the running
+		//ones when training, and the running ones otherwise.
+		bool training = true;
+		double eps = 1e-5, momentum = 0.1;
+		std::vector<double> running_mean, running_var;
+
+		//The mean and variance are found in one pass. Only changes the state
+		//when training a batch norm.
+		void forward(const Matrix& x, const Matrix& param, Matrix& out);
+		//The forward of evaluation mode, which never changes the state, so
+		//many threads may call it at the same time.
+		void infer(const Matrix& x, const Matrix& param, Matrix& out) const;
+		//Add the grads of x and param. Either may be null.
+		void backward(const Matrix& x, const Matrix& param, const Matrix& grad, Matrix* x_grad, Matrix* param_grad) const;
+	};
+
+	//The state of a dropout node.
+	struct DropoutKernel {
+		//The probability that an element is zeroed.
+		double p = 0.5;
+		//Only drops elements when training.
+		bool training = true;
+		Philox gen = Philox::next();
+		//Every forward takes new counters, so it draws a new mask.
+		uint64_t calls = 0;
+
+		//Keep every element with probability 1 - p and scale it by 1 / (1 - p).
+		//The kept elements are set in mask, which is cleared when nothing is dropped.
+		void forward(const Matrix& x, Matrix& out, std::vector<uint64_t>& mask);
+		//Add the grad of x.
+		void backward(const Matrix& grad, const std::vector<uint64_t>& mask, Matrix& x_grad) const;
+	};
+
+	//Optimize the graph of output in place:
+	//equal nodes with the same inputs are merged (common subexpression
+	//elimination), and every chain of elementwise nodes whose inner results
+	//are used only inside the chain becomes one fused node.
+	//Nodes that some Var still points to are kept. Returns the number of nodes removed.
+	size_t optimize_graph(Var& output);
+
 	//A Scalar class for Tensor.
 	class Scalar {
 	public:
@@ -137,6 +571,9 @@ namespace nn {
 		Var operator()(Var&&);
 
 		virtual Var forward(Var&) = 0;
+		//Switch between training and inference. Only changes layers such as BatchNorm1d.
+		virtual void train(bool mode = true);
+		void eval();
 	};
 
 	class Linear :public Module {
@@ -146,6 +583,123 @@ namespace nn {
 	public:
 		Linear(size_t in_features, size_t out_features, bool bias = true);
 		Var forward(Var&);
+
+		bool has_bias() const;
+		//The weight (in_features x out_features) and the bias (1 x out_features).
+		Var& weight();
+		Var& bias();
+	};
+
+	//A lookup table of num_embeddings vectors of size embedding_dim.
+	//The input holds row numbers (N x L), and the output is N x (L * embedding_dim).
+	//Only the rows that are looked up are updated by SGD and Adam.
+	class Embedding :public Module {
+		size_t m = 0, n = 0;
+		Var w;
+	public:
+		Embedding(size_t num_embeddings, size_t embedding_dim);
+		Var forward(Var&);
+
+		//The table (num_embeddings x embedding_dim).
+		Var& weight();
+	};
+
+	//Normalize every feature over the batch, then scale and shift it.
+	//In eval mode, the running statistics are used instead.
+	class BatchNorm1d :public Module {
+		std::shared_ptr<NormKernel> kernel;
+		Var w;
+		friend class Sequential;
+	public:
+		BatchNorm1d(size_t features, double momentum = 0.1, double eps = 1e-5);
+		Var forward(Var&);
+		void train(bool mode = true) override;
+
+		//gamma (the first row) and beta (the second row).
+		Var& weight();
+		const std::vector<double>& running_mean() const;
+		const std::vector<double>& running_var() const;
+	};
+
+	//Zero every element with probability p while training, and scale the others by 1 / (1 - p).
+	//The mask is kept as bits for backward. Does nothing after eval().
+	class Dropout :public Module {
+		std::shared_ptr<DropoutKernel> kernel;
+	public:
+		Dropout(double p = 0.5);
+		Var forward(Var&);
+		void train(bool mode = true) override;
+	};
+
+	//Normalize every row over its features, then scale and shift it.
+	class LayerNorm :public Module {
+		std::shared_ptr<NormKernel> kernel;
+		Var w;
+	public:
+		LayerNorm(size_t features, double eps = 1e-5);
+		Var forward(Var&);
+
+		//gamma (the first row) and beta (the second row).
+		Var& weight();
+	};
+
+	//A 1d convolution of N x (in_channels * length) inputs.
+	class Conv1d :public Module {
+		std::shared_ptr<const ConvKernel> kernel;
+		Var w;
+	public:
+		Conv1d(size_t in_channels, size_t out_channels, size_t length, size_t kernel_size,
+			size_t stride = 1, size_t padding = 0, bool bias = true);
+		Var forward(Var&);
+
+		//The length of the output.
+		size_t output_length() const;
+		//(in_channels * kernel_size) x out_channels, and one more row for the bias.
+		Var& weight();
+	};
+
+	//A 2d convolution of N x (in_channels * height * width) inputs.
+	class Conv2d :public Module {
+		std::shared_ptr<const ConvKernel> kernel;
+		Var w;
+	public:
+		Conv2d(size_t in_channels, size_t out_channels, size_t height, size_t width, size_t kernel_size,
+			size_t stride = 1, size_t padding = 0, bool bias = true);
+		Var forward(Var&);
+
+		//The height and width of the output.
+		std::pair<size_t, size_t> output_size() const;
+		//(in_channels * kernel_size^2) x out_channels, and one more row for the bias.
+		Var& weight();
+	};
+
+	//Pooling layers. The stride is kernel_size when it is 0.
+	class MaxPool1d :public Module {
+		std::shared_ptr<const ConvKernel> kernel;
+	public:
+		MaxPool1d(size_t channels, size_t length, size_t kernel_size, size_t stride = 0);
+		Var forward(Var&);
+	};
+
+	class MaxPool2d :public Module {
+		std::shared_ptr<const ConvKernel> kernel;
+	public:
+		MaxPool2d(size_t channels, size_t height, size_t width, size_t kernel_size, size_t stride = 0);
+		Var forward(Var&);
+	};
+
+	class AvgPool1d :public Module {
+		std::shared_ptr<const ConvKernel> kernel;
+	public:
+		AvgPool1d(size_t channels, size_t length, size_t kernel_size, size_t stride = 0);
+		Var forward(Var&);
+	};
+
+	class AvgPool2d :public Module {
+		std::shared_ptr<const ConvKernel> kernel;
+	public:
+		AvgPool2d(size_t channels, size_t height, size_t width, size_t kernel_size, size_t stride = 0);
+		Var forward(Var&);
 	};
 
 	class RNNCell :public Module {
@@ -175,6 +729,7 @@ namespace nn {
 	};
 
 	class LSTM :public Module {
+		friend class QuantizedLSTM;
 		size_t m = 0, n = 0;
 		bool if_b = true;
 		Var w_ii, w_hi, w_if, w_hf, w_ig, w_hg, w_io, w_ho;
@@ -219,9 +774,584 @@ namespace nn {
 		}
 
 		Var forward(Var&);
+		void train(bool mode = true) override;
+		//Fold every BatchNorm1d that follows a Linear with bias into the Linear,
+		//using the running statistics, and remove it. Build the graph again afterwards.
+		void fold_batch_norm();
+
+		const std::vector<std::shared_ptr<Module>>& layers() const;
 	};
 
-	
+	//-------------------Quantization-----------------------
+	//Post-training int8 quantization for inference.
+	//Weights are quantized per output channel and activations per tensor,
+	//both symmetric, and the products are accumulated in int32.
+	class QuantizedLinear {
+	public:
+		size_t m = 0, n = 0;
+		//n x m, one row per output channel.
+		std::vector<int8_t> w;
+		std::vector<double> w_scale, b;
+		//Scale of the input, from the calibrated range.
+		double x_scale = 1.0;
+
+		QuantizedLinear() = default;
+		QuantizedLinear(Linear& layer, double input_range);
+		QuantizedLinear(const Matrix& weight, const Matrix& bias, double input_range);
+
+		//Quantize x with x_scale.
+		std::vector<int8_t> quantize(const Matrix& x) const;
+		//int8 x int8 -> int32 products of quantized rows.
+		std::vector<int32_t> accumulate(const std::vector<int8_t>& x, size_t rows) const;
+		Matrix forward(const Matrix& x) const;
+	};
+
+	class QuantizedLSTM {
+		size_t m = 0, n = 0;
+		//The four gates (i, f, g, o) side by side, 4n x m and 4n x n.
+		QuantizedLinear x_gates, h_gates;
+	public:
+		Matrix h_s, c_s;
+		QuantizedLSTM(LSTM& layer, double input_range);
+		//Clear the hidden states.
+		void init(size_t batch_size);
+		//One time step. The hidden states are updated.
+		Matrix forward(const Matrix& x);
+	};
+
+	//A quantized copy of a Sequential made of Linear, ReLU, TanH and Sigmoid.
+	//Dropout layers are left out.
+	//The input ranges of the Linear layers are calibrated on sample data.
+	//A Linear followed by another Linear (with at most a ReLU between them)
+	//requantizes its int32 output straight to int8.
+	class QuantizedSequential {
+		enum Layer_op { linear, re, th, sig };
+		std::vector<Layer_op> ops;
+		std::vector<QuantizedLinear> linears;
+	public:
+		QuantizedSequential(Sequential& net, const Matrix& calibration_data);
+		Matrix forward(const Matrix& x) const;
+		//Bytes used by the weights and biases.
+		size_t weight_bytes() const;
+	};
+
+	//Fill w from a new stream, in parallel for large weights. For uniform, the
+	//numbers are in [a - b, a + b]. For normal, a is the mean and b the std.
+	//For the other schemes, b is the gain.
+	void init_weights(Matrix& w, Init scheme, double a = 0.0, double b = 1.0);
+	void init_weights(Var& w, Init scheme, double a = 0.0, double b = 1.0);
+
+	//-------------------Static Networks--------------------
+	//Copies of small trained networks with the shapes fixed at compile time,
+	//for single-sample inference. The weights live inside the objects, all the
+	//loops have constant bounds, and the layers are called without virtual calls.
+	template<size_t In, size_t Out>
+	class StaticLinear {
+	public:
+		static constexpr size_t in_features = In, out_features = Out;
+		//In x Out like Linear, so every input adds one contiguous row.
+		std::array<std::array<double, Out>, In> w{};
+		std::array<double, Out> b{};
+
+		StaticLinear() = default;
+		explicit StaticLinear(Linear& layer) { load(layer); }
+
+		void load(Linear& layer) {
+			auto& weight = layer.weight().graph_data().data;
+			if (weight.shape != std::make_pair(In, Out))
+				throw "Bad layer size!";
+			for (size_t i = 0; i < In; ++i)
+				for (size_t j = 0; j < Out; ++j)
+					w[i][j] = weight.data[i][j];
+			b.fill(0.0);
+			if (layer.has_bias())
+				for (size_t j = 0; j < Out; ++j)
+					b[j] = layer.bias().graph_data().data.data[0][j];
+		}
+		void load(Module& layer) {
+			auto p = dynamic_cast<Linear*>(&layer);
+			if (not p)
+				throw "Bad layer type!";
+			load(*p);
+		}
+
+		static constexpr size_t width(size_t) { return Out; }
+		template<size_t N>
+		void forward(const double* x, double* y) const {
+			static_assert(N == In, "Bad input size!");
+			for (size_t j = 0; j < Out; ++j)
+				y[j] = b[j];
+			for (size_t i = 0; i < In; ++i) {
+				auto a = x[i];
+				auto& row = w[i];
+				for (size_t j = 0; j < Out; ++j)
+					y[j] += a * row[j];
+			}
+		}
+	};
+
+	//An elementwise layer that keeps the width. Module_Type is the layer it is loaded from.
+	template<class Op, class Module_Type>
+	class StaticActivation {
+	public:
+		void load(Module& layer) {
+			if (not dynamic_cast<Module_Type*>(&layer))
+				throw "Bad layer type!";
+		}
+
+		static constexpr size_t width(size_t n) { return n; }
+		template<size_t N>
+		void forward(const double* x, double* y) const {
+			for (size_t j = 0; j < N; ++j)
+				y[j] = Op::apply(x[j]);
+		}
+	};
+	using StaticReLU = StaticActivation<expr::Relu, ReLU>;
+	using StaticTanH = StaticActivation<expr::Tanh, TanH>;
+	using StaticSigmoid = StaticActivation<expr::Sigmoid, Sigmoid>;
+
+	template<class... Layers>
+	constexpr std::array<size_t, sizeof...(Layers) + 1> static_widths() {
+		std::array<size_t, sizeof...(Layers) + 1> ans{};
+		ans[0] = std::tuple_element_t<0, std::tuple<Layers...>>::in_features;
+		size_t k = 0, n = ans[0];
+		((n = Layers::width(n), ans[++k] = n), ...);
+		return ans;
+	}
+	template<size_t N>
+	constexpr size_t static_max(const std::array<size_t, N>& a) {
+		size_t ans = 0;
+		for (auto p : a)
+			ans = p > ans ? p : ans;
+		return ans;
+	}
+
+	//A Sequential of static layers. The first layer must be a StaticLinear.
+	//Sample:
+	//	nn::StaticSequential<nn::StaticLinear<1, 5>, nn::StaticReLU, nn::StaticLinear<5, 1>> fast(net);
+	//	auto y = fast.forward({ 0.5 });
+	template<class... Layers>
+	class StaticSequential {
+		std::tuple<Layers...> layers;
+		//The width after each layer, starting from the input.
+		static constexpr auto shape = static_widths<Layers...>();
+		static constexpr size_t max_width = static_max(shape);
+
+		template<size_t K>
+		void run(const double* x, double* buf, double* out) const {
+			if constexpr (K < sizeof...(Layers)) {
+				auto y = K + 1 == sizeof...(Layers) ? out : buf + (K % 2) * max_width;
+				std::get<K>(layers).template forward<shape[K]>(x, y);
+				run<K + 1>(y, buf, out);
+			}
+		}
+	public:
+		static constexpr size_t in_features = shape.front(), out_features = shape.back();
+
+		StaticSequential() = default;
+		//Copy the weights of net, whose layers must match Layers one by one.
+		explicit StaticSequential(Sequential& net) { load(net); }
+
+		void load(Sequential& net) {
+			auto& seq = net.layers();
+			if (seq.size() != sizeof...(Layers))
+				throw "Bad layer count!";
+			size_t k = 0;
+			std::apply([&](auto&... p) { (p.load(*seq[k++]), ...); }, layers);
+		}
+
+		std::array<double, out_features> forward(const std::array<double, in_features>& x) const {
+			std::array<double, out_features> ans;
+			double buf[2 * max_width];
+			run<0>(x.data(), buf, ans.data());
+			return ans;
+		}
+		//One sample per row.
+		Matrix forward(const Matrix& x) const {
+			if (x.shape.second != in_features)
+				throw "Bad input size!";
+			Matrix ans(x.shape.first, out_features);
+			double buf[2 * max_width];
+			for (size_t i = 0; i < x.shape.first; ++i)
+				run<0>(x.data[i].data(), buf, ans.data[i].data());
+			return ans;
+		}
+	};
+
+	//-------------------Code Export------------------------
+	//Write net as a C++ header that needs nothing but <cmath>: the weights are
+	//constexpr arrays and predict(x, y) in namespace name runs the layers with
+	//fixed sizes. The layers must be Linear, ReLU, TanH and Sigmoid, starting with a
+	//Linear. Dropout layers are left out. Throws if a weight is nan or infinite.
+	void export_cpp(Sequential& net, std::ostream& out, const std::string& name = "model");
+
+	//-------------------Inference--------------------------
+	//The activations of one inference request.
+	//Every thread keeps its own context and reuses it between requests.
+	class InferenceContext {
+		friend class InferenceModel;
+		std::vector<Matrix> values;
+		std::vector<const Matrix*> ptrs;
+	};
+
+	//An immutable copy of a calculation graph for inference.
+	//The weights are copied once when it is built and only read afterwards.
+	//All the activations live in the InferenceContext of the request, so one
+	//model can serve many threads at the same time without locks.
+	class InferenceModel {
+		struct Node {
+			Var::Var_op op = Var::none;
+			double op_num = 0.0;
+			//Indices of the inputs, or of the constant of a leaf.
+			size_t a = npos, b = npos, constant = npos;
+			//The inputs and the program of a fused node.
+			std::vector<size_t> inputs;
+			std::shared_ptr<const FusedKernel> kernel;
+			std::shared_ptr<const ConvKernel> conv_kernel;
+			//A copy used only through the const infer(), so forward never changes it.
+			std::shared_ptr<const NormKernel> norm_kernel;
+		};
+		static constexpr size_t npos = size_t(-1);
+		std::vector<Node> nodes;
+		std::vector<Matrix> constants;
+		size_t input_id = npos;
+		std::pair<size_t, size_t> in_shape;
+	public:
+		//Copy the graph of output. The data of input is given to every request.
+		InferenceModel(Var& output, Var& input);
+
+		//The shape of the input when the model was built.
+		std::pair<size_t, size_t> input_shape() const;
+		//The result stays valid until the context is used again.
+		const Matrix& forward(const Matrix& x, InferenceContext& ctx) const;
+		Matrix forward(const Matrix& x) const;
+	};
+
+	//An in-process server that batches single-row requests for an InferenceModel.
+	//Requests go onto a lock-free queue. A scheduler thread takes up to
+	//max_batch of them, waiting at most max_wait microseconds after the first
+	//one, runs one batched forward and sends every row of the result back.
+	//The scheduler sleeps while the queue is empty. If the forward pass
+	//throws, the futures of the batch get the exception and its callbacks
+	//are not called. Exceptions thrown by callbacks are ignored.
+	class BatchingServer {
+		struct Request {
+			std::vector<double> x;
+			std::promise<std::vector<double>> promise;
+			std::function<void(std::vector<double>)> callback;
+			std::chrono::steady_clock::time_point start;
+			std::atomic<Request*> next{ nullptr };
+		};
+		std::shared_ptr<const InferenceModel> model;
+		size_t max_batch;
+		std::chrono::duration<double, std::micro> max_wait;
+
+		//Intrusive multi-producer single-consumer queue.
+		std::atomic<Request*> head;
+		Request* tail;
+		Request stub;
+		void push(Request*);
+		Request* pop();
+
+		//Requests submitted and not yet taken by the scheduler.
+		std::atomic<size_t> queued{ 0 };
+		std::atomic<bool> stop{ false }, sleeping{ false };
+		std::mutex wake_mtx;
+		std::condition_variable wake_cv;
+		std::thread scheduler;
+		void enqueue(Request*);
+		void schedule();
+
+		mutable std::mutex stats_mtx;
+		std::vector<double> latencies;
+		std::vector<size_t> batch_sizes;
+	public:
+		struct Stats {
+			size_t requests = 0, batches = 0;
+			//Latency percentiles in microseconds, from submit to result.
+			double p50 = 0.0, p90 = 0.0, p99 = 0.0, max = 0.0;
+			//batch_sizes[k] is the number of batches with k rows.
+			std::vector<size_t> batch_sizes;
+		};
+
+		BatchingServer(std::shared_ptr<const InferenceModel> model, size_t max_batch = 32, double max_wait = 100.0);
+		BatchingServer(const BatchingServer&) = delete;
+		//Finish the requests in the queue and stop.
+		~BatchingServer();
+
+		//Both throw once the server is stopping.
+		std::future<std::vector<double>> submit(std::vector<double> x);
+		void submit(std::vector<double> x, std::function<void(std::vector<double>)> callback);
+
+		Stats stats() const;
+		void reset_stats();
+		void print_stats() const;
+	};
+
+	//-------------------Parallel---------------------------
+	//A fixed pool of threads for fork-join loops.
+	//The calling thread takes part in the work, so a pool of size n owns n-1 threads.
+	class ThreadPool {
+		std::vector<std::thread> workers;
+		std::mutex mtx, run_mtx;
+		std::condition_variable cv, done_cv;
+		const std::function<void(size_t)>* job = nullptr;
+		size_t job_n = 0, generation = 0, busy = 0;
+		std::atomic<size_t> next{ 0 }, pending{ 0 };
+		std::atomic<bool> failed{ false };
+		std::exception_ptr error;
+		bool stop = false;
+
+		void work();
+	public:
+		ThreadPool(size_t n_threads = std::thread::hardware_concurrency());
+		ThreadPool(const ThreadPool&) = delete;
+		~ThreadPool();
+
+		//A pool with one thread per core, used by the library functions.
+		static ThreadPool& shared();
+
+		size_t size() const;
+		//Call fn(i) for every i in [0, n) and wait until all of them finish.
+		//Called from inside a job of the same pool, or while another thread
+		//runs a job on it, it runs serially.
+		//If a call throws, the calls that have not started are skipped and
+		//run() throws the first exception after the others finish.
+		void run(size_t n, const std::function<void(size_t)>& fn);
+	};
+
+	//Data-parallel trainer.
+	//Every worker owns a replica of the graph returned by build(x, y) and runs
+	//calculate/backward on its shard of the batch. The gradients are summed
+	//into the first replica with a parallel tree reduction, the optimizer runs
+	//once there and the new weights are sent back to the other replicas.
+	//build() must create a new model every time it is called.
+	class DataParallel {
+		struct Replica {
+			Var x, y, loss;
+			std::vector<Var*> params;
+		};
+		std::vector<Replica> replicas;
+		ThreadPool pool;
+
+		void broadcast_parameters();
+	public:
+		DataParallel(size_t n_workers, const std::function<Var(Var&, Var&)>& build);
+
+		size_t size() const;
+		//The loss of the first replica, which holds the trained weights.
+		Var& loss();
+		//Train one step on the batch (x, y) and return the loss of the batch.
+		double step(const Matrix& x, const Matrix& y, Var::Optim func = Var::SGD, double LR = 0.001);
+	};
+
+	//Asynchronous lock-free trainer in the style of Hogwild.
+	//Every thread trains its own replica of the graph returned by build(x, y)
+	//on its own part of the data, and writes SGD updates into one shared copy
+	//of the parameters with relaxed atomics and no locks. Updates that race
+	//may be lost, which is accepted by design.
+	class Hogwild {
+		struct Replica {
+			Var x, y, loss;
+			std::vector<Var*> params;
+			std::vector<Matrix> velocity;
+		};
+		std::vector<Replica> replicas;
+		std::vector<std::unique_ptr<std::atomic<double>[]>> shared;
+		ThreadPool pool;
+
+		void pull(Replica&);
+	public:
+		//Momentum of every thread's own SGD.
+		double momentum = 0.0;
+		//A thread reads the shared parameters again at least every
+		//max_staleness steps, so its view is at most that many steps old.
+		size_t max_staleness = 1;
+
+		Hogwild(size_t n_threads, const std::function<Var(Var&, Var&)>& build);
+
+		size_t size() const;
+		//The loss of the first replica. Its parameters are the shared ones after train().
+		Var& loss();
+		//Every thread runs `steps` mini-batches of batch_size rows taken from its own part of (x, y).
+		void train(const Matrix& x, const Matrix& y, size_t batch_size, size_t steps, double LR = 0.001);
+	};
+
+	//Trains on large batches in micro-batches, so the graph returned by
+	//build(x, y) only holds the activations of one micro-batch at a time.
+	//The parameter grads of the micro-batches are summed, weighted by their
+	//number of rows, and the optimizer runs once per batch. The next
+	//micro-batch is loaded on another thread while the current one runs.
+	//A step matches one full batch, up to rounding, only when the loss is a
+	//mean over the rows and no layer uses batch statistics: BatchNorm
+	//normalizes every micro-batch by its own mean and variance.
+	class GradientAccumulator {
+		Var x, y, loss_;
+		std::vector<Var*> params;
+		std::vector<Matrix> acc;
+		size_t micro_batch;
+	public:
+		//Load the next micro-batch while the current one runs.
+		bool overlap = true;
+
+		GradientAccumulator(size_t micro_batch, const std::function<Var(Var&, Var&)>& build);
+
+		Var& loss();
+		//Train one step on the batch (x, y), split into micro-batches, and return the loss of the batch.
+		double step(const Matrix& x, const Matrix& y, Var::Optim func = Var::SGD, double LR = 0.001);
+		//Train one step on n_micro micro-batches, where load(k, x, y) fills micro-batch k.
+		//Only two micro-batches are in memory at a time.
+		double step(size_t n_micro, const std::function<void(size_t, Matrix&, Matrix&)>& load,
+			Var::Optim func = Var::SGD, double LR = 0.001);
+	};
+
+	//Pipeline-parallel trainer for a Sequential.
+	//The layers are split into stages, each run by its own thread. Micro-batches
+	//go forward and their grads come back through bounded lock-free queues
+	//between neighbouring stages, in a 1F1B order: once a stage has enough
+	//micro-batches in flight, it alternates one forward and one backward. So
+	//the time of a step approaches the slowest stage instead of the sum of them.
+	//Every stage keeps one copy of its graph per micro-batch in flight, and
+	//the copies share the parameters of net. A module may only be used once in net.
+	class Pipeline {
+		struct Channel;
+		struct Replica {
+			Var in, y, out, pred;
+		};
+		struct Stage {
+			std::vector<Replica> replicas;
+			std::vector<Var*> params;
+			std::vector<Matrix> acc;
+		};
+		std::vector<Stage> stages;
+		//forward_queues[s] goes from stage s to s + 1 and backward_queues[s] from s + 1 to s.
+		std::vector<std::unique_ptr<Channel>> forward_queues, backward_queues;
+		size_t micro_batch;
+		ThreadPool pool;
+		std::atomic<bool> running{ false }, aborted{ false };
+
+		void build(Sequential& net, const std::vector<size_t>& stage_sizes, const std::function<Var(Var&, Var&)>& loss);
+		//Run stage(s) for every stage on its own thread. The first exception
+		//stops the other stages and is thrown again.
+		void run_stages(const std::function<void(size_t)>& stage);
+	public:
+		//stage_sizes is the number of layers in every stage, which must add up to the layers of net.
+		//loss(pred, label), such as MSE_Loss, is added after the last stage.
+		Pipeline(Sequential& net, const std::vector<size_t>& stage_sizes, size_t micro_batch,
+			const std::function<Var(Var&, Var&)>& loss);
+		Pipeline(const Pipeline&) = delete;
+		~Pipeline();
+
+		size_t size() const;
+		//step() and forward() may not run at the same time on one Pipeline.
+		//Train one step on the batch (x, y) and return the loss of the batch.
+		//The grads of all the micro-batches are summed, weighted by their rows, before the optimizer runs.
+		double step(const Matrix& x, const Matrix& y, Var::Optim func = Var::SGD, double LR = 0.001);
+		//The output of net for x, computed in micro-batches through the stages,
+		//with BatchNorm1d and Dropout in evaluation mode.
+		Matrix forward(const Matrix& x);
+	};
+
+	//A group of processes connected in a ring, for distributed training.
+	//addresses[i] is where process i listens, "host:port" for TCP or
+	//"unix:/path" for a Unix socket. All the processes must use the same list.
+	class ProcessGroup {
+		size_t rank_ = 0, world = 1;
+		int next_fd = -1, prev_fd = -1;
+
+		void exchange(const double* send_buf, size_t send_n, double* recv_buf, size_t recv_n);
+	public:
+		ProcessGroup(size_t rank, const std::vector<std::string>& addresses, double timeout = 30.0);
+		ProcessGroup(const ProcessGroup&) = delete;
+		~ProcessGroup();
+
+		size_t rank() const;
+		size_t size() const;
+		//Sum buf over all the processes with a ring all-reduce.
+		void all_reduce(std::vector<double>& buf);
+		//Copy buf of process root to all the other processes.
+		void broadcast(std::vector<double>& buf, size_t root = 0);
+	};
+
+	//Copy the parameters of process root to all the other processes.
+	void broadcast_parameters(Var& loss, ProcessGroup& group, size_t root = 0);
+	//Backward pass whose parameter grads are averaged over the group.
+	//The grads are all-reduced in buckets of about bucket_size numbers while
+	//the rest of the graph is still running backward.
+	void distributed_backward(Var& loss, ProcessGroup& group, size_t bucket_size = 1 << 16);
+
+	//-------------------Sweep------------------------------
+	//A read-only dataset in a file mapped into memory. The pages are shared by
+	//every thread and process that opens the file, and nothing is parsed.
+	//The file holds the number of columns of x and of y as two uint64, and
+	//then every row of x followed by the same row of y, as doubles.
+	class MappedDataset {
+		void* map = nullptr;
+		size_t map_size = 0, n_rows = 0, x_cols = 0, y_cols = 0;
+		const double* values = nullptr;
+	public:
+		explicit MappedDataset(const std::string& path);
+		MappedDataset(const MappedDataset&) = delete;
+		~MappedDataset();
+		//Write (x, y) in the format read by the constructor.
+		static void save(const std::string& path, const Matrix& x, const Matrix& y);
+
+		size_t size() const;
+		//The columns of x and of y.
+		std::pair<size_t, size_t> features() const;
+		//Copy n rows from row begin into x and y, going back to the first row after the last one.
+		void batch(size_t begin, size_t n, Matrix& x, Matrix& y) const;
+	};
+
+	//One model of a sweep. build(x, y) must create a new model, as for DataParallel.
+	struct Trial {
+		std::string name;
+		std::function<Var(Var&, Var&)> build;
+		Var::Optim optim = Var::SGD;
+		double LR = 0.001;
+	};
+
+	//Trains many independent models at the same time, one job per model.
+	//Every round trains the remaining trials and finds their validation loss,
+	//with the graph in evaluation mode.
+	//Then only the best 1 / eta of them go on to the next round, which has eta
+	//times the steps (successive halving). Once one trial is left, it trains
+	//alone for the remaining rounds.
+	class Sweep {
+		const MappedDataset& train;
+		const MappedDataset& valid;
+		ThreadPool pool;
+	public:
+		struct Result {
+			std::string name;
+			size_t steps = 0, rounds = 0;
+			//The mean training loss of the last round and the validation loss after it.
+			double train_loss = 0.0, valid_loss = 0.0;
+		};
+		size_t batch_size = 64, eta = 2;
+
+		Sweep(const MappedDataset& train, const MappedDataset& valid, size_t n_threads = std::thread::hardware_concurrency());
+
+		//Return the results in the order of trials. If metrics is given, a CSV
+		//row "trial,round,steps,train_loss,valid_loss" is written for every trial of every round.
+		std::vector<Result> run(const std::vector<Trial>& trials, size_t first_steps, size_t rounds, std::ostream* metrics = nullptr);
+	};
+
+	//-------------------Reductions-------------------------
+	//Sums with the same bits for any number of threads. The values are cut
+	//into blocks of a fixed size. Every block is summed in a fixed number of
+	//lanes, the lanes are added with Neumaier's compensated summation, and the
+	//block sums are added in a fixed tree. Large inputs run the blocks in
+	//parallel on pool.
+	double sum(const double* x, size_t n, ThreadPool& pool = ThreadPool::shared());
+	double dot(const double* a, const double* b, size_t n, ThreadPool& pool = ThreadPool::shared());
+	double sum(const std::vector<double>& x, ThreadPool& pool = ThreadPool::shared());
+	double dot(const std::vector<double>& a, const std::vector<double>& b, ThreadPool& pool = ThreadPool::shared());
+	double sum(const Matrix& x, ThreadPool& pool = ThreadPool::shared());
+	double mean(const Matrix& x, ThreadPool& pool = ThreadPool::shared());
+	//The sum of a .* b.
+	double dot(const Matrix& a, const Matrix& b, ThreadPool& pool = ThreadPool::shared());
+
 	//-------------------Functions--------------------------
 	Var zeros(size_t m, size_t n);
 	Var ones(size_t m, size_t n);
@@ -234,9 +1364,55 @@ namespace nn {
 	Var shape_as(Var&&, double val = 0.0);
 
 	Var MSE_Loss(Var& pred, Var& label);
+	//The mean cross entropy of softmax(logits) and the labels, as one node.
+	//label is N x K with one-hot rows (or probabilities), or N x 1 with the class numbers.
+	Var SoftmaxCrossEntropy(Var& logits, Var& label);
 	
-	//Input:X,Y Output:W,B
+	//Solve A*X=B with partial pivoting. A is m x n with m >= n.
 	std::vector<double> solve_linear_equation(const std::vector<std::vector<double>>& A, const std::vector<double>& B);
+	//Solve A*X=B for a symmetric positive definite A.
+	std::vector<double> cholesky_solve(const std::vector<std::vector<double>>& A, const std::vector<double>& B);
+	//Input:X,Y Output:W,B
 	std::tuple<std::vector<double>, double>
 		linear_regression(const std::vector<std::vector<double>>&, const std::vector<double>&);
+
+	//The statistics a linear regression needs: the means of x and y and the
+	//co-moments sum((x - x_mean)(x - x_mean)^T) and sum((x - x_mean)(y - y_mean)).
+	//Rows can be added in many calls, e.g. while streaming them from disk.
+	class RegressionStats {
+	public:
+		size_t n = 0;
+		double count = 0.0, y_mean = 0.0;
+		//sxx is n x n, row-major.
+		std::vector<double> x_mean, sxx, sxy;
+
+		RegressionStats(size_t n_features = 0);
+		//Add the rows in [begin, end) on this thread.
+		void add_block(const std::vector<std::vector<double>>& x, const std::vector<double>& y, size_t begin, size_t end);
+		//Add all the rows, in parallel.
+		void add(const std::vector<std::vector<double>>& x, const std::vector<double>& y);
+		void merge(const RegressionStats& rhs);
+		//Add one row of weight 1 after multiplying the weight of the old rows by decay.
+		void add_row(const std::vector<double>& x, double y, double decay = 1.0);
+		//Output:W,B
+		std::tuple<std::vector<double>, double> solve() const;
+	};
+
+	//A linear regression that is updated when new rows arrive, without
+	//scanning the old ones again. Every row costs O(n^2).
+	//With forgetting < 1 the weight of the old rows is multiplied by it for
+	//every new row, so the fit follows data that drifts.
+	class OnlineRegression {
+		RegressionStats stats;
+	public:
+		double forgetting;
+
+		OnlineRegression(size_t n_features, double forgetting = 1.0);
+		void add(const std::vector<double>& x, double y);
+		void add(const std::vector<std::vector<double>>& x, const std::vector<double>& y);
+		//The weight of the rows seen so far, with the forgetting applied.
+		double count() const;
+		//Output:W,B
+		std::tuple<std::vector<double>, double> solve() const;
+	};
 }
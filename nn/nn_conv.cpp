@@ -0,0 +1,314 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------CONV KERNEL--------------------------------
+	size_t ConvKernel::out_h() const {
+		return (height + 2 * pad_h - kernel_h) / stride_h + 1;
+	}
+
+	size_t ConvKernel::out_w() const {
+		return (width + 2 * pad_w - kernel_w) / stride_w + 1;
+	}
+
+	size_t ConvKernel::patch_size() const {
+		return channels * kernel_h * kernel_w + (bias ? 1 : 0);
+	}
+
+	namespace {
+		//Row oy * out_w + ox of cols holds the pixels of image x under the kernel at (oy, ox).
+		void im2col(const ConvKernel& k, const std::vector<double>& x, Matrix& cols) {
+			size_t oh = k.out_h(), ow = k.out_w();
+			if (cols.shape != std::make_pair(oh * ow, k.patch_size()) or cols.data.size() != oh * ow)
+				cols = Matrix(oh * ow, k.patch_size());
+			for (size_t oy = 0; oy < oh; ++oy)
+				for (size_t ox = 0; ox < ow; ++ox) {
+					auto& row = cols.data[oy * ow + ox];
+					size_t idx = 0;
+					for (size_t c = 0; c < k.channels; ++c)
+						for (size_t ky = 0; ky < k.kernel_h; ++ky) {
+							//Unsigned, so the padding wraps around and fails the range check.
+							size_t iy = oy * k.stride_h + ky - k.pad_h;
+							for (size_t kx = 0; kx < k.kernel_w; ++kx) {
+								size_t ix = ox * k.stride_w + kx - k.pad_w;
+								row[idx++] = iy < k.height and ix < k.width ? x[(c * k.height + iy) * k.width + ix] : 0.0;
+							}
+						}
+					if (k.bias)
+						row[idx] = 1.0;
+				}
+		}
+
+		//out += a^T * b without making a^T. Four rows of a and b are taken at a
+		//time, so every row of out is read and written once per four of them.
+		void add_t_matmul(const Matrix& a, const Matrix& b, Matrix& out) {
+			size_t n = b.shape.second, p = 0;
+			for (; p + 4 <= a.shape.first; p += 4) {
+				auto b0 = b.data[p].data(), b1 = b.data[p + 1].data(), b2 = b.data[p + 2].data(), b3 = b.data[p + 3].data();
+				for (size_t k = 0; k < a.shape.second; ++k) {
+					auto a0 = a.data[p][k], a1 = a.data[p + 1][k], a2 = a.data[p + 2][k], a3 = a.data[p + 3][k];
+					auto out_row = out.data[k].data();
+					for (size_t c = 0; c < n; ++c)
+						out_row[c] += a0 * b0[c] + a1 * b1[c] + a2 * b2[c] + a3 * b3[c];
+				}
+			}
+			for (; p < a.shape.first; ++p)
+				for (size_t k = 0; k < a.shape.second; ++k) {
+					auto x = a.data[p][k];
+					auto out_row = out.data[k].data();
+					for (size_t c = 0; c < n; ++c)
+						out_row[c] += x * b.data[p][c];
+				}
+		}
+
+		//The reverse of im2col: add every entry of cols to the pixel it came from.
+		void col2im(const ConvKernel& k, const Matrix& cols, std::vector<double>& x) {
+			size_t oh = k.out_h(), ow = k.out_w();
+			for (size_t oy = 0; oy < oh; ++oy)
+				for (size_t ox = 0; ox < ow; ++ox) {
+					auto& row = cols.data[oy * ow + ox];
+					size_t idx = 0;
+					for (size_t c = 0; c < k.channels; ++c)
+						for (size_t ky = 0; ky < k.kernel_h; ++ky) {
+							size_t iy = oy * k.stride_h + ky - k.pad_h;
+							for (size_t kx = 0; kx < k.kernel_w; ++kx, ++idx) {
+								size_t ix = ox * k.stride_w + kx - k.pad_w;
+								if (iy < k.height and ix < k.width)
+									x[(c * k.height + iy) * k.width + ix] += row[idx];
+							}
+						}
+				}
+		}
+
+		//Call fn(begin, end) for blocks of the rows [0, n) on the shared pool.
+		void for_blocks(size_t n, const std::function<void(size_t, size_t)>& fn) {
+			auto& pool = ThreadPool::shared();
+			size_t blocks = std::min(n, pool.size());
+			pool.run(blocks, [&](size_t b) {
+				fn(n * b / blocks, n * (b + 1) / blocks);
+			});
+		}
+	}
+
+	void ConvKernel::forward(Var::Var_op op, const Matrix& x, const Matrix* w, Matrix& out) const {
+		if (x.shape.second != channels * height * width)
+			throw "Bad input size!";
+		size_t rows = x.shape.first, oh = out_h(), ow = out_w(), pixels = oh * ow;
+
+		if (op == Var::conv_op) {
+			assert(w and w->shape.first == patch_size());
+			size_t out_c = w->shape.second;
+			if (out.shape != std::make_pair(rows, out_c * pixels) or out.data.size() != rows)
+				out = Matrix(rows, out_c * pixels);
+			for_blocks(rows, [&](size_t begin, size_t end) {
+				Matrix cols, res;
+				for (size_t i = begin; i < end; ++i) {
+					im2col(*this, x.data[i], cols);
+					cols.matmul(*w, res);
+					for (size_t p = 0; p < pixels; ++p)
+						for (size_t c = 0; c < out_c; ++c)
+							out.data[i][c * pixels + p] = res.data[p][c];
+				}
+			});
+			return;
+		}
+
+		if (out.shape != std::make_pair(rows, channels * pixels) or out.data.size() != rows)
+			out = Matrix(rows, channels * pixels);
+		bool max = op == Var::max_pool_op;
+		for_blocks(rows, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+				for (size_t c = 0; c < channels; ++c)
+					for (size_t oy = 0; oy < oh; ++oy)
+						for (size_t ox = 0; ox < ow; ++ox) {
+							double ans = max ? -INFINITY : 0.0;
+							for (size_t ky = 0; ky < kernel_h; ++ky) {
+								size_t iy = oy * stride_h + ky - pad_h;
+								for (size_t kx = 0; kx < kernel_w; ++kx) {
+									size_t ix = ox * stride_w + kx - pad_w;
+									if (iy >= height or ix >= width)
+										continue;
+									auto v = x.data[i][(c * height + iy) * width + ix];
+									ans = max ? std::max(ans, v) : ans + v;
+								}
+							}
+							out.data[i][(c * oh + oy) * ow + ox] = max ? ans : ans / double(kernel_h * kernel_w);
+						}
+		});
+	}
+
+	void ConvKernel::backward(Var::Var_op op, const Matrix& x, const Matrix* w, const Matrix& grad, Matrix* x_grad, Matrix* w_grad) const {
+		size_t rows = x.shape.first, oh = out_h(), ow = out_w(), pixels = oh * ow;
+
+		if (op == Var::conv_op) {
+			size_t out_c = w->shape.second;
+			auto& pool = ThreadPool::shared();
+			size_t blocks = std::min(rows, pool.size());
+			//Every block sums the weight grad of its images, and the sums are added at the end.
+			std::vector<Matrix> partial(w_grad ? blocks : 0);
+			Matrix w_t;
+			if (x_grad)
+				w_t = w->transpose();
+			pool.run(blocks, [&](size_t b) {
+				Matrix cols, res(pixels, out_c), dcols;
+				if (w_grad)
+					partial[b] = Matrix(patch_size(), out_c);
+				for (size_t i = rows * b / blocks; i < rows * (b + 1) / blocks; ++i) {
+					for (size_t p = 0; p < pixels; ++p)
+						for (size_t c = 0; c < out_c; ++c)
+							res.data[p][c] = grad.data[i][c * pixels + p];
+					if (w_grad) {
+						im2col(*this, x.data[i], cols);
+						add_t_matmul(cols, res, partial[b]);
+					}
+					if (x_grad) {
+						res.matmul(w_t, dcols);
+						col2im(*this, dcols, x_grad->data[i]);
+					}
+				}
+			});
+			for (auto& p : partial)
+				*w_grad += p;
+			return;
+		}
+
+		if (not x_grad)
+			return;
+		bool max = op == Var::max_pool_op;
+		for_blocks(rows, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i)
+				for (size_t c = 0; c < channels; ++c)
+					for (size_t oy = 0; oy < oh; ++oy)
+						for (size_t ox = 0; ox < ow; ++ox) {
+							auto g = grad.data[i][(c * oh + oy) * ow + ox];
+							//The grad of max pooling goes to the first largest pixel.
+							size_t best = size_t(-1);
+							double best_v = -INFINITY;
+							for (size_t ky = 0; ky < kernel_h; ++ky) {
+								size_t iy = oy * stride_h + ky - pad_h;
+								for (size_t kx = 0; kx < kernel_w; ++kx) {
+									size_t ix = ox * stride_w + kx - pad_w;
+									if (iy >= height or ix >= width)
+										continue;
+									size_t pos = (c * height + iy) * width + ix;
+									if (not max)
+										x_grad->data[i][pos] += g / double(kernel_h * kernel_w);
+									else if (best == size_t(-1) or x.data[i][pos] > best_v) {
+										best = pos;
+										best_v = x.data[i][pos];
+									}
+								}
+							}
+							if (max and best != size_t(-1))
+								x_grad->data[i][best] += g;
+						}
+		});
+	}
+
+	//-------------------------CONV---------------------------------------
+	Var Var::conv(Var& weight, const std::shared_ptr<const ConvKernel>& kernel) {
+		Var ans;
+		ans.op = conv_op;
+		ans.conv_kernel = kernel;
+		ans.num1 = node();
+		ans.num2 = weight.node();
+		return ans;
+	}
+	Var Var::max_pool(const std::shared_ptr<const ConvKernel>& kernel) {
+		Var ans;
+		ans.op = max_pool_op;
+		ans.conv_kernel = kernel;
+		ans.num1 = node();
+		return ans;
+	}
+	Var Var::avg_pool(const std::shared_ptr<const ConvKernel>& kernel) {
+		Var ans;
+		ans.op = avg_pool_op;
+		ans.conv_kernel = kernel;
+		ans.num1 = node();
+		return ans;
+	}
+
+	namespace {
+		std::shared_ptr<const ConvKernel> make_kernel(size_t channels, size_t height, size_t width,
+			size_t kernel_h, size_t kernel_w, size_t stride, size_t padding, bool bias) {
+			auto ans = std::make_shared<ConvKernel>();
+			ans->channels = channels, ans->height = height, ans->width = width;
+			ans->kernel_h = kernel_h, ans->kernel_w = kernel_w;
+			ans->stride_h = ans->stride_w = stride;
+			ans->pad_h = height == 1 ? 0 : padding, ans->pad_w = padding;
+			ans->bias = bias;
+			if (stride == 0 or height + 2 * ans->pad_h < kernel_h or width + 2 * padding < kernel_w)
+				throw "Bad kernel size!";
+			return ans;
+		}
+	}
+
+	Conv1d::Conv1d(size_t in_channels, size_t out_channels, size_t length, size_t kernel_size,
+		size_t stride, size_t padding, bool bias) :
+		kernel(make_kernel(in_channels, 1, length, 1, kernel_size, stride, padding, bias)),
+		w(kernel->patch_size(), out_channels, true, 0.0, 1.0 / sqrt(in_channels * kernel_size)) {
+		w.requires_optim = true;
+	}
+	Var Conv1d::forward(Var& x) {
+		auto y = x.conv(w, kernel);
+		return y;
+	}
+	size_t Conv1d::output_length() const {
+		return kernel->out_w();
+	}
+	Var& Conv1d::weight() {
+		return w;
+	}
+
+	Conv2d::Conv2d(size_t in_channels, size_t out_channels, size_t height, size_t width, size_t kernel_size,
+		size_t stride, size_t padding, bool bias) :
+		kernel(make_kernel(in_channels, height, width, kernel_size, kernel_size, stride, padding, bias)),
+		w(kernel->patch_size(), out_channels, true, 0.0, 1.0 / sqrt(in_channels * kernel_size * kernel_size)) {
+		w.requires_optim = true;
+	}
+	Var Conv2d::forward(Var& x) {
+		auto y = x.conv(w, kernel);
+		return y;
+	}
+	std::pair<size_t, size_t> Conv2d::output_size() const {
+		return { kernel->out_h(), kernel->out_w() };
+	}
+	Var& Conv2d::weight() {
+		return w;
+	}
+
+	//-------------------------POOLING------------------------------------
+	MaxPool1d::MaxPool1d(size_t channels, size_t length, size_t kernel_size, size_t stride) :
+		kernel(make_kernel(channels, 1, length, 1, kernel_size, stride ? stride : kernel_size, 0, false)) {}
+	Var MaxPool1d::forward(Var& x) {
+		auto y = x.max_pool(kernel);
+		return y;
+	}
+
+	MaxPool2d::MaxPool2d(size_t channels, size_t height, size_t width, size_t kernel_size, size_t stride) :
+		kernel(make_kernel(channels, height, width, kernel_size, kernel_size, stride ? stride : kernel_size, 0, false)) {}
+	Var MaxPool2d::forward(Var& x) {
+		auto y = x.max_pool(kernel);
+		return y;
+	}
+
+	AvgPool1d::AvgPool1d(size_t channels, size_t length, size_t kernel_size, size_t stride) :
+		kernel(make_kernel(channels, 1, length, 1, kernel_size, stride ? stride : kernel_size, 0, false)) {}
+	Var AvgPool1d::forward(Var& x) {
+		auto y = x.avg_pool(kernel);
+		return y;
+	}
+
+	AvgPool2d::AvgPool2d(size_t channels, size_t height, size_t width, size_t kernel_size, size_t stride) :
+		kernel(make_kernel(channels, height, width, kernel_size, kernel_size, stride ? stride : kernel_size, 0, false)) {}
+	Var AvgPool2d::forward(Var& x) {
+		auto y = x.avg_pool(kernel);
+		return y;
+	}
+}
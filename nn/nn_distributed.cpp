@@ -0,0 +1,310 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------SOCKETS------------------------------------
+	namespace {
+		struct Address {
+			bool unix_socket = false;
+			std::string host, port;
+		};
+
+		//"unix:/path/to/socket" or "host:port".
+		Address parse_address(const std::string& s) {
+			Address ans;
+			if (s.compare(0, 5, "unix:") == 0) {
+				ans.unix_socket = true;
+				ans.host = s.substr(5);
+				return ans;
+			}
+			auto pos = s.rfind(':');
+			if (pos == std::string::npos)
+				throw "Bad address!";
+			ans.host = s.substr(0, pos);
+			ans.port = s.substr(pos + 1);
+			return ans;
+		}
+
+		int open_socket(const Address& addr, bool listening) {
+			if (addr.unix_socket) {
+				sockaddr_un sa{};
+				sa.sun_family = AF_UNIX;
+				if (addr.host.size() >= sizeof(sa.sun_path))
+					throw "Bad address!";
+				strcpy(sa.sun_path, addr.host.c_str());
+				int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+				if (fd < 0)
+					throw "Socket error!";
+				if (listening) {
+					unlink(sa.sun_path);
+					if (bind(fd, (sockaddr*)&sa, sizeof(sa)) < 0 or listen(fd, 1) < 0) {
+						close(fd);
+						throw "Bind error!";
+					}
+				}
+				else if (connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0) {
+					close(fd);
+					return -1;
+				}
+				return fd;
+			}
+
+			addrinfo hints{}, * res = nullptr;
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_flags = listening ? AI_PASSIVE : 0;
+			if (getaddrinfo(addr.host.empty() ? nullptr : addr.host.c_str(), addr.port.c_str(), &hints, &res) != 0)
+				throw "Bad address!";
+			int fd = -1;
+			for (auto p = res; p; p = p->ai_next) {
+				fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+				if (fd < 0)
+					continue;
+				if (listening) {
+					int one = 1;
+					setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+					if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 and listen(fd, 1) == 0)
+						break;
+				}
+				else if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+					int one = 1;
+					setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+					break;
+				}
+				close(fd);
+				fd = -1;
+			}
+			freeaddrinfo(res);
+			if (listening and fd < 0)
+				throw "Bind error!";
+			return fd;
+		}
+	}
+
+	//-------------------------PROCESS GROUP------------------------------
+	ProcessGroup::ProcessGroup(size_t rank, const std::vector<std::string>& addresses, double timeout) :
+		rank_(rank), world(addresses.size()) {
+		assert(rank < world);
+		if (world == 1)
+			return;
+
+		auto self = parse_address(addresses[rank]);
+		auto next = parse_address(addresses[(rank + 1) % world]);
+		int listen_fd = open_socket(self, true);
+
+		//The next process may not listen yet, so keep trying.
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+		while ((next_fd = open_socket(next, false)) < 0) {
+			if (std::chrono::steady_clock::now() > deadline) {
+				close(listen_fd);
+				throw "Connection timeout!";
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		prev_fd = accept(listen_fd, nullptr, nullptr);
+		close(listen_fd);
+		if (self.unix_socket)
+			unlink(self.host.c_str());
+		if (prev_fd < 0)
+			throw "Connection failed!";
+		if (not self.unix_socket) {
+			int one = 1;
+			setsockopt(prev_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+	}
+
+	ProcessGroup::~ProcessGroup() {
+		if (next_fd >= 0)
+			close(next_fd);
+		if (prev_fd >= 0)
+			close(prev_fd);
+	}
+
+	size_t ProcessGroup::rank() const {
+		return rank_;
+	}
+
+	size_t ProcessGroup::size() const {
+		return world;
+	}
+
+	void ProcessGroup::exchange(const double* send_buf, size_t send_n, double* recv_buf, size_t recv_n) {
+		//Send to the next process and receive from the previous one at the same
+		//time, or the ring would block once the socket buffers are full.
+		auto out = (const char*)send_buf;
+		auto in = (char*)recv_buf;
+		size_t out_left = send_n * sizeof(double), in_left = recv_n * sizeof(double);
+		while (out_left or in_left) {
+			pollfd fds[2] = { { next_fd, short(out_left ? POLLOUT : 0), 0 }, { prev_fd, short(in_left ? POLLIN : 0), 0 } };
+			if (poll(fds, 2, -1) < 0)
+				throw "Connection failed!";
+			if (out_left and (fds[0].revents & (POLLOUT | POLLERR | POLLHUP))) {
+				auto k = send(next_fd, out, out_left, MSG_NOSIGNAL | MSG_DONTWAIT);
+				if (k < 0 and errno != EAGAIN and errno != EWOULDBLOCK)
+					throw "Connection failed!";
+				if (k > 0)
+					out += k, out_left -= k;
+			}
+			if (in_left and (fds[1].revents & (POLLIN | POLLERR | POLLHUP))) {
+				auto k = recv(prev_fd, in, in_left, MSG_DONTWAIT);
+				if (k == 0 or (k < 0 and errno != EAGAIN and errno != EWOULDBLOCK))
+					throw "Connection failed!";
+				if (k > 0)
+					in += k, in_left -= k;
+			}
+		}
+	}
+
+	void ProcessGroup::all_reduce(std::vector<double>& buf) {
+		if (world == 1 or buf.empty())
+			return;
+
+		//Ring all-reduce: a reduce-scatter followed by an all-gather, each
+		//process sends 2(n-1)/n of the buffer in total.
+		std::vector<size_t> begin(world + 1);
+		for (size_t i = 0; i <= world; ++i)
+			begin[i] = buf.size() * i / world;
+		auto chunk = [&](size_t i) { return (i % world + world) % world; };
+		std::vector<double> tmp(begin[1] - begin[0] + 1);
+
+		for (size_t s = 0; s + 1 < world; ++s) {
+			auto send_c = chunk(rank_ + world - s), recv_c = chunk(rank_ + world - s - 1);
+			tmp.resize(begin[recv_c + 1] - begin[recv_c]);
+			exchange(buf.data() + begin[send_c], begin[send_c + 1] - begin[send_c], tmp.data(), tmp.size());
+			for (size_t i = 0; i < tmp.size(); ++i)
+				buf[begin[recv_c] + i] += tmp[i];
+		}
+		for (size_t s = 0; s + 1 < world; ++s) {
+			auto send_c = chunk(rank_ + world + 1 - s), recv_c = chunk(rank_ + world - s);
+			exchange(buf.data() + begin[send_c], begin[send_c + 1] - begin[send_c],
+				buf.data() + begin[recv_c], begin[recv_c + 1] - begin[recv_c]);
+		}
+	}
+
+	void ProcessGroup::broadcast(std::vector<double>& buf, size_t root) {
+		if (world == 1 or buf.empty())
+			return;
+
+		//Pass the buffer along the ring, starting from the root.
+		size_t pos = (rank_ + world - root) % world;
+		if (pos != 0)
+			exchange(nullptr, 0, buf.data(), buf.size());
+		if (pos + 1 != world)
+			exchange(buf.data(), buf.size(), nullptr, 0);
+	}
+
+	//-------------------------DISTRIBUTED TRAINING-----------------------
+	void broadcast_parameters(Var& loss, ProcessGroup& group, size_t root) {
+		auto params = loss.parameters();
+		std::vector<double> buf;
+		for (auto p : params)
+			for (auto& row : p->data.data)
+				buf.insert(buf.end(), row.begin(), row.end());
+		group.broadcast(buf, root);
+
+		size_t k = 0;
+		for (auto p : params)
+			for (auto& row : p->data.data)
+				for (auto& q : row)
+					q = buf[k++];
+	}
+
+	void distributed_backward(Var& loss, ProcessGroup& group, size_t bucket_size) {
+		if (group.size() == 1) {
+			loss.backward();
+			return;
+		}
+
+		//The grads are packed into buckets in the order they become ready, and a
+		//second thread all-reduces each full bucket while backward goes on.
+		//Every process builds the same graph, so the buckets match.
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::deque<std::vector<Var*>> ready;
+		bool finished = false;
+		const char* error = nullptr;
+
+		std::thread comm([&] {
+			while (true) {
+				std::vector<Var*> bucket;
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					cv.wait(lock, [&] { return finished or not ready.empty(); });
+					if (ready.empty())
+						return;
+					bucket = std::move(ready.front());
+					ready.pop_front();
+				}
+				if (error)
+					continue;
+
+				std::vector<double> buf;
+				for (auto p : bucket)
+					for (auto& row : p->grad.data)
+						buf.insert(buf.end(), row.begin(), row.end());
+				try {
+					group.all_reduce(buf);
+				}
+				catch (const char* e) {
+					error = e;
+					continue;
+				}
+				size_t k = 0;
+				for (auto p : bucket) {
+					for (auto& row : p->grad.data)
+						for (auto& q : row)
+							q = buf[k++] / double(group.size());
+					//The other processes may have changed other rows.
+					p->grad_dense = true;
+				}
+			}
+		});
+
+		std::vector<Var*> bucket;
+		size_t bucket_n = 0;
+		auto flush = [&] {
+			if (bucket.empty())
+				return;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				ready.emplace_back(std::move(bucket));
+			}
+			cv.notify_one();
+			bucket.clear();
+			bucket_n = 0;
+		};
+		loss.backward([&](Var* p) {
+			bucket.push_back(p);
+			bucket_n += p->grad.shape.first * p->grad.shape.second;
+			if (bucket_n >= bucket_size)
+				flush();
+		});
+		flush();
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			finished = true;
+		}
+		cv.notify_one();
+		comm.join();
+		if (error)
+			throw error;
+	}
+}
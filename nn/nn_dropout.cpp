@@ -0,0 +1,84 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------DROPOUT KERNEL-----------------------------
+	void DropoutKernel::forward(const Matrix& x, Matrix& out, std::vector<uint64_t>& mask) {
+		size_t m = x.shape.first, n = x.shape.second;
+		if (out.shape != x.shape or out.data.size() != m)
+			out = Matrix(m, n);
+		if (not training or p == 0.0) {
+			mask.clear();
+			for (size_t i = 0; i < m; ++i)
+				std::copy(x.data[i].begin(), x.data[i].end(), out.data[i].begin());
+			return;
+		}
+		if (p < 0.0 or p >= 1.0)
+			throw "Bad dropout rate!";
+
+		//Element e is kept when number e of the stream is at least p * 2^32.
+		//Each forward has its own range of 2^32 counters.
+		auto threshold = uint32_t(std::min(4294967295.0, p * 4294967296.0));
+		size_t total = m * n;
+		mask.assign((total + 63) / 64, 0);
+		uint64_t first = calls++ << 32;
+		uint32_t bits[256];
+		for (size_t e = 0; e < total; e += 256) {
+			size_t k = std::min(size_t(256), total - e);
+			gen(first + e / 4, (k + 3) / 4, bits);
+			for (size_t i = 0; i < k; ++i)
+				mask[(e + i) / 64] |= uint64_t(bits[i] >= threshold) << ((e + i) % 64);
+		}
+
+		//The mask and the scale are one multiply.
+		double scale = 1.0 / (1.0 - p);
+		for (size_t i = 0; i < m; ++i) {
+			auto& in = x.data[i];
+			auto& o = out.data[i];
+			for (size_t j = 0, e = i * n; j < n; ++j, ++e)
+				o[j] = in[j] * (double((mask[e / 64] >> (e % 64)) & 1) * scale);
+		}
+	}
+
+	void DropoutKernel::backward(const Matrix& grad, const std::vector<uint64_t>& mask, Matrix& x_grad) const {
+		size_t m = grad.shape.first, n = grad.shape.second;
+		double scale = mask.empty() ? 1.0 : 1.0 / (1.0 - p);
+		for (size_t i = 0; i < m; ++i) {
+			auto& g = grad.data[i];
+			auto& dx = x_grad.data[i];
+			if (mask.empty())
+				for (size_t j = 0; j < n; ++j)
+					dx[j] += g[j];
+			else
+				for (size_t j = 0, e = i * n; j < n; ++j, ++e)
+					dx[j] += g[j] * (double((mask[e / 64] >> (e % 64)) & 1) * scale);
+		}
+	}
+
+	Var Var::dropout(const std::shared_ptr<DropoutKernel>& kernel) {
+		Var ans;
+		ans.op = dropout_op;
+		ans.dropout_kernel = kernel;
+		ans.num1 = node();
+		return ans;
+	}
+
+	//-------------------------DROPOUT LAYER------------------------------
+	Dropout::Dropout(double p) :kernel(std::make_shared<DropoutKernel>()) {
+		if (p < 0.0 or p >= 1.0)
+			throw "Bad dropout rate!";
+		kernel->p = p;
+	}
+	Var Dropout::forward(Var& x) {
+		auto y = x.dropout(kernel);
+		return y;
+	}
+	void Dropout::train(bool mode) {
+		kernel->training = mode;
+	}
+}
@@ -0,0 +1,100 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------CODE EXPORT--------------------------------
+	namespace {
+		//Enough digits to read back the same double. nan and inf have no literal.
+		void write_row(std::ostream& out, const std::vector<double>& row) {
+			for (auto p : row)
+				if (not std::isfinite(p))
+					throw "Non-finite weight!";
+			out << "{ ";
+			for (size_t j = 0; j < row.size(); ++j)
+				out << (j ? ", " : "") << std::setprecision(17) << row[j];
+			out << " }";
+		}
+
+		void write_activation(std::ostream& out, const std::string& expr, const std::string& h, size_t n) {
+			out << "\tfor (std::size_t j = 0; j < " << n << "; ++j)\n"
+				<< "\t\t" << h << "[j] = " << expr << ";\n";
+		}
+	}
+
+	void export_cpp(Sequential& net, std::ostream& out, const std::string& name) {
+		std::ostringstream weights, body;
+		size_t in_features = 0, width = 0, k = 0;
+		std::string cur = "x";
+		for (auto& p : net.layers()) {
+			if (auto layer = dynamic_cast<Linear*>(p.get())) {
+				auto& w = layer->weight().graph_data().data;
+				if (k == 0)
+					in_features = width = w.shape.first;
+				else if (w.shape.first != width)
+					throw "Bad layer size!";
+				auto id = std::to_string(k++);
+				std::vector<double> b(w.shape.second, 0.0);
+				if (layer->has_bias())
+					b = layer->bias().graph_data().data.data[0];
+
+				weights << "constexpr double w" << id << "[" << w.shape.first << "][" << w.shape.second << "] = {\n";
+				for (auto& row : w.data) {
+					weights << "\t";
+					write_row(weights, row);
+					weights << ",\n";
+				}
+				weights << "};\nconstexpr double b" << id << "[" << b.size() << "] = ";
+				write_row(weights, b);
+				weights << ";\n";
+
+				//Every input adds one row of the weights, like StaticLinear.
+				auto h = "h" + id;
+				body << "\tdouble " << h << "[" << b.size() << "];\n"
+					<< "\tfor (std::size_t j = 0; j < " << b.size() << "; ++j)\n"
+					<< "\t\t" << h << "[j] = b" << id << "[j];\n"
+					<< "\tfor (std::size_t i = 0; i < " << width << "; ++i)\n"
+					<< "\t\tfor (std::size_t j = 0; j < " << b.size() << "; ++j)\n"
+					<< "\t\t\t" << h << "[j] += " << cur << "[i] * w" << id << "[i][j];\n";
+				cur = h;
+				width = b.size();
+			}
+			//Dropout does nothing in inference.
+			else if (dynamic_cast<Dropout*>(p.get()))
+				continue;
+			else if (k == 0)
+				throw "The first layer must be Linear!";
+			else if (dynamic_cast<ReLU*>(p.get()))
+				write_activation(body, cur + "[j] > 0 ? " + cur + "[j] : 0.0", cur, width);
+			else if (dynamic_cast<TanH*>(p.get()))
+				write_activation(body, "std::tanh(" + cur + "[j])", cur, width);
+			else if (dynamic_cast<Sigmoid*>(p.get()))
+				write_activation(body, "1.0 / (1.0 + std::exp(-" + cur + "[j]))", cur, width);
+			else
+				throw "Unsupported layer!";
+		}
+		if (k == 0)
+			throw "The first layer must be Linear!";
+		body << "\tfor (std::size_t j = 0; j < " << width << "; ++j)\n"
+			<< "\t\ty[j] = " << cur << "[j];\n";
+
+		out << "//Generated by nn::export_cpp(). Do not edit.\n"
+			<< "#pragma once\n\n"
+			<< "#include <cmath>\n"
+			<< "#include <cstddef>\n\n"
+			<< "namespace " << name << " {\n"
+			<< "constexpr std::size_t in_features = " << in_features << ", out_features = " << width << ";\n\n"
+			<< weights.str() << "\n"
+			<< "//x has in_features values and y has out_features.\n"
+			<< "inline void predict(const double* x, double* y) {\n"
+			<< body.str()
+			<< "}\n"
+			<< "}\n";
+	}
+}
@@ -4,6 +4,9 @@
 #include <memory>
 #include <random>
 #include <tuple>
+#include <cmath>
+#include <limits>
+#include <algorithm>
 #include "nn.h"
 
 namespace nn {
@@ -18,32 +21,26 @@ namespace nn {
 	Var ones_like(Var& rhs) {
 		Var ans;
 		ans.op = Var::ones_like;
-		ans.num1 = std::make_shared<Var>(std::move(rhs));
+		ans.num1 = rhs.node();
 		return ans;
 	}
 	Var ones_like(Var&& rhs) {
 		Var ans;
 		ans.op = Var::ones_like;
-		ans.num1 = std::make_shared<Var>(rhs);
+		ans.num1 = rhs.node();
 		return ans;
 	}
 
 	Var ones_vector(Var& rhs) {
 		Var ans;
 		ans.op = Var::ones_vector;
-		if (rhs.graph_ptr)
-			ans.num1 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num1 = std::make_shared<Var>(rhs);
+		ans.num1 = rhs.node();
 		return ans;
 	}
 	Var ones_vector(Var&& rhs) {
 		Var ans;
 		ans.op = Var::ones_vector;
-		if (rhs.graph_ptr)
-			ans.num1 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num1 = std::make_shared<Var>(rhs);
+		ans.num1 = rhs.node();
 		return ans;
 	}
 
@@ -56,20 +53,14 @@ namespace nn {
 		Var ans;
 		ans.op = Var::from_double;
 		ans.op_num = val;
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var shape_as(Var&& rhs, double val) {
 		Var ans;
 		ans.op = Var::from_double;
 		ans.op_num = val;
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num2 = rhs.node();
 		return ans;
 	}
 
@@ -81,47 +72,64 @@ namespace nn {
 		return total_loss.mean();
 	}
 
+	Var SoftmaxCrossEntropy(Var& logits, Var& label) {
+		logits.requires_grad = true;
+		label.requires_grad = false;
+
+		Var ans;
+		ans.op = Var::softmax_ce;
+		ans.num1 = logits.node();
+		ans.num2 = label.node();
+		return ans;
+	}
+
 	std::vector<double> solve_linear_equation(const std::vector<std::vector<double>>& A, const std::vector<double>& B) {
 		size_t m = A.size(), n = A.front().size();
+		if (m < n)
+			throw "Rank does not match!";
 		std::vector<double> X(n, 0);
 		std::vector<std::vector<double>> C(m, std::vector<double>(n + 1));
-		for (int i = 0; i < m; ++i) {
-			for (int j = 0; j < n; ++j)
+		double scale = 0.0;
+		for (size_t i = 0; i < m; ++i) {
+			for (size_t j = 0; j < n; ++j) {
 				C[i][j] = A[i][j];
+				scale = std::max(scale, std::abs(A[i][j]));
+			}
 			C[i].back() = B[i];
 		}
+		//Values below eps are treated as zero when checking the rank.
+		double eps = scale * double(m) * std::numeric_limits<double>::epsilon();
 
-		//Simplify A.
-		for (int j = 0;; ++j) {
-			//Check the rank
-			if (j == n) {
-				for (int k = n; k < m; ++k) {
-					if (C[k][n] != 0.0)
-						throw "Rank Error!";
-				}
-				break;
-			}
-
-			//Swap the not 0 to the first place.
-			for (int i = j;; ++i) {
-				if (i == m)
-					throw "Rank does not match!";
-				if (C[i][j]) {
-					swap(C[j], C[i]);
-					break;
-				}
-			}
+		//Gaussian elimination with partial pivoting.
+		for (size_t j = 0; j < n; ++j) {
+			size_t pivot = j;
+			for (size_t i = j + 1; i < m; ++i)
+				if (std::abs(C[i][j]) > std::abs(C[pivot][j]))
+					pivot = i;
+			if (std::abs(C[pivot][j]) <= eps)
+				throw "Rank does not match!";
+			std::swap(C[j], C[pivot]);
 
-			for (int i = j + 1; i < m; ++i) {
+			for (size_t i = j + 1; i < m; ++i) {
 				auto l = C[i][j] / C[j][j];
-				for (int k = j; k <= n; ++k)
+				if (l == 0.0)
+					continue;
+				for (size_t k = j; k <= n; ++k)
 					C[i][k] -= C[j][k] * l;
 			}
 		}
 
-		for (int i = n - 1; i >= 0; --i) {
+		//Check the rank.
+		double b_scale = 0.0;
+		for (auto p : B)
+			b_scale = std::max(b_scale, std::abs(p));
+		for (size_t k = n; k < m; ++k)
+			if (std::abs(C[k][n]) > (b_scale + scale) * double(m) * 1e-9)
+				throw "Rank Error!";
+
+		for (size_t i = n; i-- > 0;) {
 			double tmp = C[i][n];
-			for (int j = i + 1; j < n; ++j) {
+			for (size_t j = i + 1; j < n; ++j) {
 				tmp -= C[i][j] * X[j];
 			}
 			X[i] = tmp / C[i][i];
@@ -130,39 +138,204 @@ namespace nn {
 		return X;
 	}
 
-	std::tuple<std::vector<double>, double>
-		linear_regression(const std::vector<std::vector<double>>& x, const std::vector<double>& y) {
-		assert(x.size() == y.size());
-		size_t n = x.front().size(), l = x.size();
-		std::vector<double> x_mean(n, 0.0);
-		double y_mean = 0.0;
-
-		for (size_t i = 0; i < l; ++i) {
-			for (size_t j = 0; j < n; ++j) {
-				x_mean[j] += x[i][j] / double(l);
+	std::vector<double> cholesky_solve(const std::vector<std::vector<double>>& A, const std::vector<double>& B) {
+		size_t n = A.size();
+		assert(B.size() == n);
+		//A = L * L^T.
+		std::vector<std::vector<double>> L(n, std::vector<double>(n, 0.0));
+		for (size_t j = 0; j < n; ++j) {
+			double d = A[j][j];
+			for (size_t k = 0; k < j; ++k)
+				d -= L[j][k] * L[j][k];
+			if (not (d > std::abs(A[j][j]) * 1e-12))
+				throw "Not positive definite!";
+			L[j][j] = std::sqrt(d);
+			for (size_t i = j + 1; i < n; ++i) {
+				double v = A[i][j];
+				for (size_t k = 0; k < j; ++k)
+					v -= L[i][k] * L[j][k];
+				L[i][j] = v / L[j][j];
 			}
-			y_mean += y[i] / double(l);
 		}
 
-		std::vector<std::vector<double>> s(n, std::vector<double>(n, 0.0));
-		std::vector<double> sy(n, 0.0);
+		std::vector<double> X(B);
+		for (size_t i = 0; i < n; ++i) {
+			for (size_t k = 0; k < i; ++k)
+				X[i] -= L[i][k] * X[k];
+			X[i] /= L[i][i];
+		}
+		for (size_t i = n; i-- > 0;) {
+			for (size_t k = i + 1; k < n; ++k)
+				X[i] -= L[k][i] * X[k];
+			X[i] /= L[i][i];
+		}
+		return X;
+	}
+
+	//-------------------------REGRESSION---------------------------------
+	RegressionStats::RegressionStats(size_t n_features) :
+		n(n_features), x_mean(n_features, 0.0), sxx(n_features * n_features, 0.0), sxy(n_features, 0.0) {}
+
+	void RegressionStats::merge(const RegressionStats& rhs) {
+		assert(rhs.n == n);
+		if (rhs.count == 0.0)
+			return;
+		if (count == 0.0) {
+			*this = rhs;
+			return;
+		}
 
+		//Pairwise update of Chan et al.
+		double total = count + rhs.count, f = count * rhs.count / total;
+		std::vector<double> dx(n);
+		for (size_t j = 0; j < n; ++j)
+			dx[j] = rhs.x_mean[j] - x_mean[j];
+		double dy = rhs.y_mean - y_mean;
 		for (size_t j = 0; j < n; ++j) {
-			for (size_t k = 0; k < n; ++k) {
-				for (size_t i = 0; i < l; ++i) {
-					s[j][k] += (x[i][j] - x_mean[j]) * (x[i][k] - x_mean[k]);
-				}
+			for (size_t k = 0; k < n; ++k)
+				sxx[j * n + k] += rhs.sxx[j * n + k] + dx[j] * dx[k] * f;
+			sxy[j] += rhs.sxy[j] + dx[j] * dy * f;
+			x_mean[j] += dx[j] * rhs.count / total;
+		}
+		y_mean += dy * rhs.count / total;
+		count = total;
+	}
+
+	void RegressionStats::add_block(const std::vector<std::vector<double>>& x, const std::vector<double>& y, size_t begin, size_t end) {
+		//Tiles of rows are centered on their own means and stored by column, so
+		//that every entry of sxx is a dot product of two short arrays.
+		constexpr size_t TILE = 64;
+		std::vector<double> d(n * TILE), dy(TILE);
+		RegressionStats tile(n);
+		for (size_t t = begin; t < end; t += TILE) {
+			size_t rows = std::min(TILE, end - t);
+			std::fill(tile.x_mean.begin(), tile.x_mean.end(), 0.0);
+			tile.y_mean = 0.0;
+			for (size_t r = 0; r < rows; ++r) {
+				assert(x[t + r].size() == n);
+				for (size_t j = 0; j < n; ++j)
+					tile.x_mean[j] += x[t + r][j];
+				tile.y_mean += y[t + r];
 			}
-			for (size_t i = 0; i < l; ++i) {
-				sy[j] += (x[i][j] - x_mean[j]) * (y[i] - y_mean);
+			for (auto& p : tile.x_mean)
+				p /= double(rows);
+			tile.y_mean /= double(rows);
+
+			for (size_t r = 0; r < rows; ++r) {
+				for (size_t j = 0; j < n; ++j)
+					d[j * TILE + r] = x[t + r][j] - tile.x_mean[j];
+				dy[r] = y[t + r] - tile.y_mean;
 			}
+			for (size_t j = 0; j < n; ++j) {
+				auto dj = d.data() + j * TILE;
+				for (size_t k = j; k < n; ++k) {
+					auto dk = d.data() + k * TILE;
+					double sum = 0.0;
+					for (size_t r = 0; r < rows; ++r)
+						sum += dj[r] * dk[r];
+					tile.sxx[j * n + k] = tile.sxx[k * n + j] = sum;
+				}
+				double sum = 0.0;
+				for (size_t r = 0; r < rows; ++r)
+					sum += dj[r] * dy[r];
+				tile.sxy[j] = sum;
+			}
+			tile.count = double(rows);
+			merge(tile);
+		}
+	}
+
+	void RegressionStats::add(const std::vector<std::vector<double>>& x, const std::vector<double>& y) {
+		assert(x.size() == y.size());
+		//The rows are cut into blocks of a fixed size, and the blocks are merged
+		//in a fixed order, so the result does not depend on the number of threads.
+		//Only GROUP blocks are kept in memory at the same time.
+		constexpr size_t BLOCK = 4096, GROUP = 64;
+		size_t blocks = (x.size() + BLOCK - 1) / BLOCK;
+		std::vector<RegressionStats> parts;
+		for (size_t g = 0; g < blocks; g += GROUP) {
+			size_t k = std::min(GROUP, blocks - g);
+			parts.assign(k, RegressionStats(n));
+			ThreadPool::shared().run(k, [&](size_t i) {
+				size_t begin = (g + i) * BLOCK;
+				parts[i].add_block(x, y, begin, std::min(begin + BLOCK, x.size()));
+			});
+			for (size_t stride = 1; stride < k; stride <<= 1)
+				for (size_t i = 0; i + stride < k; i += 2 * stride)
+					parts[i].merge(parts[i + stride]);
+			merge(parts[0]);
+		}
+	}
+
+	void RegressionStats::add_row(const std::vector<double>& x, double y, double decay) {
+		assert(x.size() == n);
+		//Weighted Welford update.
+		count = count * decay + 1.0;
+		double f = 1.0 - 1.0 / count;
+		std::vector<double> dx(n);
+		for (size_t j = 0; j < n; ++j)
+			dx[j] = x[j] - x_mean[j];
+		double dy = y - y_mean;
+		for (size_t j = 0; j < n; ++j) {
+			for (size_t k = 0; k < n; ++k)
+				sxx[j * n + k] = sxx[j * n + k] * decay + dx[j] * dx[k] * f;
+			sxy[j] = sxy[j] * decay + dx[j] * dy * f;
+			x_mean[j] += dx[j] / count;
 		}
+		y_mean += dy / count;
+	}
 
-		auto w = solve_linear_equation(s, sy);
+	std::tuple<std::vector<double>, double> RegressionStats::solve() const {
+		std::vector<std::vector<double>> s(n, std::vector<double>(n));
+		for (size_t j = 0; j < n; ++j)
+			for (size_t k = 0; k < n; ++k)
+				s[j][k] = sxx[j * n + k];
+
+		//The covariance matrix is positive definite unless some features are
+		//linearly dependent, which the pivoting solver reports.
+		std::vector<double> w;
+		try {
+			w = cholesky_solve(s, sxy);
+		}
+		catch (const char*) {
+			w = solve_linear_equation(s, sxy);
+		}
 		double b = y_mean;
 		for (size_t i = 0; i < n; ++i)
 			b -= w[i] * x_mean[i];
-
 		return std::tuple<std::vector<double>, double>(w, b);
 	}
+
+	OnlineRegression::OnlineRegression(size_t n_features, double forgetting) :
+		stats(n_features), forgetting(forgetting) {}
+
+	void OnlineRegression::add(const std::vector<double>& x, double y) {
+		stats.add_row(x, y, forgetting);
+	}
+
+	void OnlineRegression::add(const std::vector<std::vector<double>>& x, const std::vector<double>& y) {
+		assert(x.size() == y.size());
+		if (forgetting == 1.0) {
+			stats.add(x, y);
+			return;
+		}
+		for (size_t i = 0; i < x.size(); ++i)
+			stats.add_row(x[i], y[i], forgetting);
+	}
+
+	double OnlineRegression::count() const {
+		return stats.count;
+	}
+
+	std::tuple<std::vector<double>, double> OnlineRegression::solve() const {
+		return stats.solve();
+	}
+
+	std::tuple<std::vector<double>, double>
+		linear_regression(const std::vector<std::vector<double>>& x, const std::vector<double>& y) {
+		assert(x.size() == y.size());
+		RegressionStats stats(x.front().size());
+		stats.add(x, y);
+		return stats.solve();
+	}
 }
@@ -0,0 +1,313 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <cmath>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------FUSED KERNEL-------------------------------
+	namespace {
+		bool unary(Var::Var_op op) {
+			return op == Var::re or op == Var::th or op == Var::sig or op == Var::ab;
+		}
+
+		bool elementwise(Var::Var_op op) {
+			return unary(op) or op == Var::plus or op == Var::minus or op == Var::times or op == Var::devides;
+		}
+
+		//Ops whose result depends only on their inputs, so equal nodes can be merged.
+		bool pure(Var::Var_op op) {
+			switch (op)
+			{
+			case nn::Var::equals:
+			case nn::Var::plus:
+			case nn::Var::minus:
+			case nn::Var::times:
+			case nn::Var::devides:
+			case nn::Var::mm:
+			case nn::Var::re:
+			case nn::Var::th:
+			case nn::Var::ab:
+			case nn::Var::sig:
+			case nn::Var::from_double:
+			case nn::Var::ones_like:
+			case nn::Var::ones_vector:
+			case nn::Var::means_op:
+			case nn::Var::emb:
+			case nn::Var::softmax_ce:
+				return true;
+			default:
+				return false;
+			}
+		}
+
+		void run(Var::Var_op op, const double* a, const double* b, double* out, size_t n) {
+			switch (op)
+			{
+			case nn::Var::plus:
+				for (size_t j = 0; j < n; ++j)
+					out[j] = a[j] + b[j];
+				break;
+			case nn::Var::minus:
+				for (size_t j = 0; j < n; ++j)
+					out[j] = a[j] - b[j];
+				break;
+			case nn::Var::times:
+				for (size_t j = 0; j < n; ++j)
+					out[j] = a[j] * b[j];
+				break;
+			case nn::Var::devides:
+				for (size_t j = 0; j < n; ++j)
+					out[j] = a[j] / b[j];
+				break;
+			case nn::Var::re:
+				for (size_t j = 0; j < n; ++j)
+					out[j] = a[j] > 0 ? a[j] : 0;
+				break;
+			case nn::Var::th:
+				for (size_t j = 0; j < n; ++j)
+					out[j] = std::tanh(a[j]);
+				break;
+			case nn::Var::sig:
+				for (size_t j = 0; j < n; ++j)
+					out[j] = 1.0 / (1.0 + ::pow(2.718281828459, -a[j]));
+				break;
+			case nn::Var::ab:
+				for (size_t j = 0; j < n; ++j)
+					out[j] = std::abs(a[j]);
+				break;
+			default:
+				throw "Unsupported op!";
+			}
+		}
+	}
+
+	void FusedKernel::forward(const std::vector<const Matrix*>& in, Matrix& out) const {
+		assert(in.size() == n_inputs and not code.empty());
+		size_t m = in[0]->shape.first, n = in[0]->shape.second;
+		if (out.shape != in[0]->shape or out.data.size() != m)
+			out = Matrix(m, n);
+
+		std::vector<std::vector<double>> regs(code.size() - 1, std::vector<double>(n));
+		auto reg = [&](size_t r, size_t i) -> const double* {
+			return r < n_inputs ? in[r]->data[i].data() : regs[r - n_inputs].data();
+		};
+		for (size_t i = 0; i < m; ++i)
+			for (size_t k = 0; k < code.size(); ++k) {
+				auto dst = k + 1 == code.size() ? out.data[i].data() : regs[k].data();
+				run(code[k].op, reg(code[k].a, i), reg(code[k].b, i), dst, n);
+			}
+	}
+
+	void FusedKernel::backward(const std::vector<const Matrix*>& in, const Matrix& grad, const std::vector<Matrix*>& in_grad) const {
+		assert(in.size() == n_inputs and in_grad.size() == n_inputs);
+		size_t m = grad.shape.first, n = grad.shape.second;
+		size_t total = n_inputs + code.size();
+
+		//The inner values are not kept by forward, so every row is calculated again.
+		std::vector<std::vector<double>> regs(code.size(), std::vector<double>(n)), adj(total, std::vector<double>(n));
+		auto reg = [&](size_t r, size_t i) -> const double* {
+			return r < n_inputs ? in[r]->data[i].data() : regs[r - n_inputs].data();
+		};
+		for (size_t i = 0; i < m; ++i) {
+			for (size_t k = 0; k < code.size(); ++k)
+				run(code[k].op, reg(code[k].a, i), reg(code[k].b, i), regs[k].data(), n);
+			for (auto& p : adj)
+				std::fill(p.begin(), p.end(), 0.0);
+			adj.back() = grad.data[i];
+
+			for (size_t k = code.size(); k-- > 0;) {
+				auto& g = adj[n_inputs + k];
+				const double* x = reg(code[k].a, i), * y = reg(code[k].b, i), * z = regs[k].data();
+				auto& ga = adj[code[k].a];
+				auto& gb = adj[code[k].b];
+				switch (code[k].op)
+				{
+				case nn::Var::plus:
+					for (size_t j = 0; j < n; ++j)
+						ga[j] += g[j], gb[j] += g[j];
+					break;
+				case nn::Var::minus:
+					for (size_t j = 0; j < n; ++j)
+						ga[j] += g[j], gb[j] -= g[j];
+					break;
+				case nn::Var::times:
+					for (size_t j = 0; j < n; ++j) {
+						auto tmp_num = g[j];
+						ga[j] += y[j] * tmp_num;
+						gb[j] += x[j] * tmp_num;
+					}
+					break;
+				case nn::Var::devides:
+					for (size_t j = 0; j < n; ++j) {
+						auto tmp_num = g[j];
+						ga[j] += tmp_num / y[j];
+						gb[j] -= x[j] / (y[j] * y[j]) * tmp_num;
+					}
+					break;
+				case nn::Var::re:
+					for (size_t j = 0; j < n; ++j)
+						ga[j] += (x[j] > 0 ? 1 : 0) * g[j];
+					break;
+				case nn::Var::th:
+					for (size_t j = 0; j < n; ++j)
+						ga[j] += (1.0 - z[j] * z[j]) * g[j];
+					break;
+				case nn::Var::sig:
+					for (size_t j = 0; j < n; ++j) {
+						auto tmp_num = ::pow(2.718281828459, -x[j]);
+						ga[j] += tmp_num / ::pow(1.0 + tmp_num, 2.0) * g[j];
+					}
+					break;
+				case nn::Var::ab:
+					for (size_t j = 0; j < n; ++j)
+						ga[j] += (x[j] > 0 ? 1 : -1) * g[j];
+					break;
+				default:
+					throw "Unsupported op!";
+				}
+			}
+
+			for (size_t r = 0; r < n_inputs; ++r)
+				if (in_grad[r])
+					for (size_t j = 0; j < n; ++j)
+						in_grad[r]->data[i][j] += adj[r][j];
+		}
+	}
+
+	//-------------------------GRAPH OPTIMIZATION-------------------------
+	namespace {
+		struct GraphInfo {
+			//Post-order, so the inputs of a node come before it.
+			std::vector<Var*> order;
+			std::unordered_map<Var*, std::shared_ptr<Var>> owner;
+			std::unordered_map<Var*, size_t> uses;
+			std::unordered_map<Var*, Var*> consumer;
+			//Nodes that a Var outside the graph points to.
+			std::unordered_set<Var*> external;
+		};
+
+		std::vector<std::shared_ptr<Var>*> children(Var* node) {
+			std::vector<std::shared_ptr<Var>*> ans;
+			if (node->num1)
+				ans.push_back(&node->num1);
+			if (node->num2)
+				ans.push_back(&node->num2);
+			for (auto& p : node->inputs)
+				ans.push_back(&p);
+			return ans;
+		}
+
+		void collect(Var* root, GraphInfo& g) {
+			std::unordered_set<Var*> visited;
+			std::function<void(Var*)> dfs = [&](Var* node) {
+				if (visited.find(node) != visited.end())
+					return;
+				visited.insert(node);
+				for (auto p : children(node)) {
+					auto child = p->get();
+					g.owner[child] = *p;
+					++g.uses[child];
+					g.consumer[child] = node;
+					dfs(child);
+				}
+				g.order.push_back(node);
+			};
+			dfs(root);
+
+			//Every edge holds one reference, and the owner map holds one more.
+			for (auto& p : g.owner)
+				if (size_t(p.second.use_count()) > g.uses[p.first] + 1)
+					g.external.insert(p.first);
+		}
+	}
+
+	size_t optimize_graph(Var& output) {
+		Var* root = &output.graph_data();
+		size_t removed = 0;
+
+		//Common subexpression elimination.
+		{
+			GraphInfo g;
+			collect(root, g);
+			std::unordered_map<Var*, std::shared_ptr<Var>> replace;
+			std::map<std::tuple<int, Var*, Var*, double, bool>, std::shared_ptr<Var>> seen;
+			for (auto node : g.order) {
+				for (auto p : children(node)) {
+					auto q = replace.find(p->get());
+					if (q != replace.end())
+						*p = q->second;
+				}
+				if (node == root or not pure(node->op))
+					continue;
+				auto key = std::make_tuple(int(node->op), node->num1.get(), node->num2.get(), node->op_num, node->requires_grad);
+				auto q = seen.find(key);
+				if (q == seen.end())
+					seen[key] = g.owner[node];
+				else if (g.external.find(node) == g.external.end()) {
+					replace[node] = q->second;
+					++removed;
+				}
+			}
+		}
+
+		//Elementwise fusion.
+		GraphInfo g;
+		collect(root, g);
+		auto inner = [&](Var* node) {
+			if (node == root or not elementwise(node->op) or g.uses[node] != 1 or g.external.count(node))
+				return false;
+			auto c = g.consumer[node];
+			return elementwise(c->op) and c->requires_grad == node->requires_grad;
+		};
+		for (auto node : g.order) {
+			if (not elementwise(node->op) or inner(node))
+				continue;
+			bool any = inner(node->num1.get()) or (not unary(node->op) and inner(node->num2.get()));
+			if (not any)
+				continue;
+
+			auto kernel = std::make_shared<FusedKernel>();
+			std::vector<std::shared_ptr<Var>> inputs;
+			std::unordered_map<Var*, size_t> ids;
+			std::function<void(const std::shared_ptr<Var>&)> gather = [&](const std::shared_ptr<Var>& p) {
+				if (inner(p.get())) {
+					gather(p->num1);
+					if (not unary(p->op))
+						gather(p->num2);
+				}
+				else if (ids.find(p.get()) == ids.end()) {
+					ids[p.get()] = inputs.size();
+					inputs.push_back(p);
+				}
+			};
+			gather(node->num1);
+			if (not unary(node->op))
+				gather(node->num2);
+			kernel->n_inputs = inputs.size();
+
+			std::function<size_t(Var*)> emit = [&](Var* p) {
+				auto a = inner(p->num1.get()) ? emit(p->num1.get()) : ids[p->num1.get()];
+				auto b = a;
+				if (not unary(p->op))
+					b = inner(p->num2.get()) ? emit(p->num2.get()) : ids[p->num2.get()];
+				kernel->code.push_back({ p->op, a, b });
+				return kernel->n_inputs + kernel->code.size() - 1;
+			};
+			emit(node);
+			removed += kernel->code.size() - 1;
+
+			node->op = Var::fused;
+			node->inputs = std::move(inputs);
+			node->kernel = kernel;
+			node->num1 = node->num2 = nullptr;
+		}
+		return removed;
+	}
+}
@@ -4,28 +4,146 @@
 #include <memory>
 #include <random>
 #include <cmath>
+#include <functional>
+#include <algorithm>
 #include "nn.h"
 
 namespace nn {
+	namespace {
+		//Post-order of the nodes that need grads.
+		void grad_order(Var* node, std::unordered_set<Var*>& visited, std::vector<Var*>& order) {
+			if (visited.find(node) != visited.end())
+				return;
+			visited.insert(node);
+			if (node->num1 and node->num1->requires_grad)
+				grad_order(node->num1.get(), visited, order);
+			if (node->num2 and node->num2->requires_grad)
+				grad_order(node->num2.get(), visited, order);
+			for (auto& p : node->inputs)
+				if (p->requires_grad)
+					grad_order(p.get(), visited, order);
+			order.push_back(node);
+		}
+
+		//Calls fn once for every node of the graph of node, including the ones without grads.
+		void visit_graph(Var* node, const std::function<void(Var*)>& fn) {
+			std::unordered_set<Var*> visited;
+			std::function<void(Var*)> dfs = [&](Var* p) {
+				if (not visited.insert(p).second)
+					return;
+				fn(p);
+				if (p->num1)
+					dfs(p->num1.get());
+				if (p->num2)
+					dfs(p->num2.get());
+				for (auto& q : p->inputs)
+					dfs(q.get());
+			};
+			dfs(node);
+		}
+
+		//The grads that node sends to its inputs are dense, except the ones of
+		//the weight of a sparse matmul and of an embedding table, which only
+		//change the rows hit by the input.
+		void mark_dense(Var* node) {
+			auto mark = [&](Var* p) {
+				bool sparse = (node->op == Var::mm and p == node->num2.get() and node->num1->sparse) or
+					(node->op == Var::emb and p == node->num1.get());
+				if (p->requires_grad and not sparse)
+					p->grad_dense = true;
+			};
+			if (node->num1)
+				mark(node->num1.get());
+			if (node->num2)
+				mark(node->num2.get());
+			for (auto& p : node->inputs)
+				mark(p.get());
+		}
+
+		void unique_rows(std::vector<size_t>& rows) {
+			std::sort(rows.begin(), rows.end());
+			rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+		}
+	}
+
 	void Var::zero_grad() {
-		grad.clear();
-		if (num1 and num1->requires_grad)
-			num1->zero_grad();
-		if (num2 and num2->requires_grad)
-			num2->zero_grad();
+		if (graph_ptr) {
+			graph_ptr->zero_grad();
+			return;
+		}
+		std::vector<Var*> order;
+		std::unordered_set<Var*> visited;
+		grad_order(this, visited, order);
+		for (auto p : order) {
+			if (p->grad_dense)
+				p->grad.clear();
+			else
+				for (auto r : p->grad_rows)
+					std::fill(p->grad.data[r].begin(), p->grad.data[r].end(), 0.0);
+			p->grad_rows.clear();
+			p->grad_dense = false;
+		}
 	}
 
 	void Var::backward() {
-		if (not graph_ptr) {
-			grad = Matrix(data.shape.first, data.shape.second, 1.0);
-			_backward();
+		backward(nullptr);
+	}
+
+	void Var::backward(const std::function<void(Var*)>& on_grad_ready) {
+		auto& root = graph_data();
+		root.backward(Matrix(root.data.shape.first, root.data.shape.second, 1.0), on_grad_ready);
+	}
+
+	void Var::backward(const Matrix& grad_output, const std::function<void(Var*)>& on_grad_ready) {
+		if (graph_ptr) {
+			graph_ptr->backward(grad_output, on_grad_ready);
+			return;
 		}
-		else {
-			graph_ptr->backward();
+		if (grad_output.shape != data.shape)
+			throw "Bad grad size!";
+		grad = grad_output;
+		grad_dense = true;
+
+		//Visit the nodes in reverse topological order, so that the grad of a
+		//node is complete before it is sent to its inputs.
+		std::vector<Var*> order;
+		std::unordered_set<Var*> visited;
+		grad_order(this, visited, order);
+
+		for (auto p = order.rbegin(); p != order.rend(); ++p) {
+			mark_dense(*p);
+			(*p)->_backward();
+			if (on_grad_ready and (*p)->requires_optim)
+				on_grad_ready(*p);
 		}
 	}
 
 	void Var::_backward() {
+		if (op == fused) {
+			std::vector<const Matrix*> in;
+			std::vector<Matrix*> in_grad;
+			for (auto& p : inputs) {
+				in.push_back(&p->data);
+				in_grad.push_back(p->requires_grad ? &p->grad : nullptr);
+			}
+			kernel->backward(in, grad, in_grad);
+			return;
+		}
+		if (conv_kernel) {
+			conv_kernel->backward(op, num1->data, num2 ? &num2->data : nullptr, grad,
+				num1->requires_grad ? &num1->grad : nullptr, num2 and num2->requires_grad ? &num2->grad : nullptr);
+			return;
+		}
+		if (norm_kernel) {
+			norm_kernel->backward(num1->data, num2->data, grad,
+				num1->requires_grad ? &num1->grad : nullptr, num2->requires_grad ? &num2->grad : nullptr);
+			return;
+		}
+		if (dropout_kernel) {
+			if (num1->requires_grad)
+				dropout_kernel->backward(grad, dropout_mask, num1->grad);
+			return;
+		}
 		if (num1 and num1->requires_grad) {
 			switch (op)
 			{
@@ -40,10 +158,10 @@ namespace nn {
 				num1->grad += grad;
 				break;
 			case nn::Var::times:
-				num1->grad += num2->data * grad;
+				num1->grad += lazy(num2->data) * lazy(grad);
 				break;
 			case nn::Var::devides:
-				num1->grad += grad / num2->data;
+				num1->grad += lazy(grad) / lazy(num2->data);
 				break;
 			case nn::Var::mm:
 				num1->grad += grad.matmul(num2->data.transpose());
@@ -83,10 +201,48 @@ namespace nn {
 				break;
 			case nn::Var::ones_vector:
 				break;
+			case nn::Var::softmax_ce: {
+				//(sum(label) * softmax(x) - label) / N for every row. A one-hot label sums to 1.
+				auto scale = grad.data[0][0] / double(num1->data.shape.first);
+				for (size_t i = 0; i < num1->data.shape.first; ++i) {
+					auto& x = num1->data.data[i];
+					auto& y = num2->data.data[i];
+					auto& g = num1->grad.data[i];
+					auto max_x = *std::max_element(x.begin(), x.end());
+					double sum = 0.0;
+					for (auto q : x)
+						sum += std::exp(q - max_x);
+					double label_sum = 1.0;
+					if (num2->data.shape.second != 1) {
+						label_sum = 0.0;
+						for (auto q : y)
+							label_sum += q;
+					}
+					for (size_t j = 0; j < x.size(); ++j)
+						g[j] += scale * label_sum * std::exp(x[j] - max_x) / sum;
+					if (num2->data.shape.second == 1)
+						g[size_t(y[0])] -= scale;
+					else
+						for (size_t j = 0; j < x.size(); ++j)
+							g[j] -= scale * y[j];
+				}
+			}
+				break;
+			case nn::Var::emb: {
+				size_t d = num1->data.shape.second;
+				for (size_t i = 0; i < num2->data.shape.first; ++i)
+					for (size_t k = 0; k < num2->data.shape.second; ++k) {
+						auto r = size_t(num2->data.data[i][k]);
+						auto& row = num1->grad.data[r];
+						for (size_t j = 0; j < d; ++j)
+							row[j] += grad.data[i][k * d + j];
+						num1->grad_rows.push_back(r);
+					}
+			}
+				break;
 			default:
 				break;
 			}
-			num1->_backward();
 		}
 		if (num2 and num2->requires_grad) {
 			switch (op)
@@ -99,16 +255,19 @@ namespace nn {
 				num2->grad += grad;
 				break;
 			case nn::Var::minus:
-				num2->grad += Matrix(data.shape.first, data.shape.second, -1.0) * grad;
+				num2->grad -= lazy(grad);
 				break;
 			case nn::Var::times:
-				num2->grad += num1->data * grad;
+				num2->grad += lazy(num1->data) * lazy(grad);
 				break;
 			case nn::Var::devides:
-				num2->grad -= num1->data / (num2->data * num2->data) * grad;
+				num2->grad -= lazy(num1->data) / (lazy(num2->data) * lazy(num2->data)) * lazy(grad);
 				break;
 			case nn::Var::mm:
-				num2->grad += num1->data.transpose().matmul(grad);
+				if (num1->sparse)
+					num1->sparse->add_transpose_matmul(grad, num2->grad, num2->grad_rows);
+				else
+					num2->grad += num1->data.transpose().matmul(grad);
 				break;
 			case nn::Var::re:
 				break;
@@ -123,13 +282,16 @@ namespace nn {
 			default:
 				break;
 			}
-			num2->_backward();
 		}
 	}
 
 	void Var::optim(Optim func, double LR) {
 		//Adam opimizer hyper parameters.
 		constexpr auto b1 = 0.9, b2 = 0.999;
+		if (graph_ptr) {
+			graph_ptr->optim(func, LR);
+			return;
+		}
 
 		std::unordered_set<Var*> visited;
 		switch (func)
@@ -140,23 +302,70 @@ namespace nn {
 		case Adam:
 			Adam_optim(LR, b1, b2, visited);
 			break;
-		default:
+		default:
 			break;
 		}
 	}
 
+	std::vector<Var*> Var::parameters() {
+		std::vector<Var*> order, params;
+		std::unordered_set<Var*> visited;
+		grad_order(&graph_data(), visited, order);
+		for (auto p : order)
+			if (p->requires_optim)
+				params.push_back(p);
+		return params;
+	}
+
+	void Var::train(bool mode) {
+		visit_graph(&graph_data(), [&](Var* node) {
+			if (node->norm_kernel)
+				node->norm_kernel->training = mode;
+			if (node->dropout_kernel)
+				node->dropout_kernel->training = mode;
+		});
+	}
+
+	TrainModeGuard::TrainModeGuard(Var& output, bool mode) {
+		visit_graph(&output.graph_data(), [&](Var* node) {
+			if (node->norm_kernel)
+				norms.emplace_back(node->norm_kernel, node->norm_kernel->training);
+			if (node->dropout_kernel)
+				dropouts.emplace_back(node->dropout_kernel, node->dropout_kernel->training);
+		});
+		output.train(mode);
+	}
+
+	TrainModeGuard::~TrainModeGuard() {
+		//In reverse, so a kernel shared by several nodes gets its first value back.
+		for (auto p = norms.rbegin(); p != norms.rend(); ++p)
+			p->first->training = p->second;
+		for (auto p = dropouts.rbegin(); p != dropouts.rend(); ++p)
+			p->first->training = p->second;
+	}
+
 	void Var::SGD_optim(double LR, std::unordered_set<Var*>& visited) {
 		if (visited.find(this) != visited.end())
 			return;
 		visited.insert(this);
 
 		if (requires_optim) {
-			data -= Matrix(data.shape.first, data.shape.second, LR) * grad;
+			if (grad_dense)
+				data -= LR * lazy(grad);
+			else {
+				unique_rows(grad_rows);
+				for (auto r : grad_rows)
+					for (size_t j = 0; j < data.shape.second; ++j)
+						data.data[r][j] -= LR * grad.data[r][j];
+			}
 		}
 		if (num1 and num1->requires_grad)
 			num1->SGD_optim(LR, visited);
 		if (num2 and num2->requires_grad)
 			num2->SGD_optim(LR, visited);
+		for (auto& p : inputs)
+			if (p->requires_grad)
+				p->SGD_optim(LR, visited);
 	}
 
 	void Var::Adam_optim(double LR, double b1, double b2, std::unordered_set<Var*>& visited) {
@@ -177,20 +386,39 @@ namespace nn {
 				adam_v = Matrix(m, n);
 			}
 
-			//Update.
-			adam_m = Matrix(m, n, b1) * adam_m + Matrix(m, n, 1.0 - b1) * grad;
-			adam_v = Matrix(m, n, b2) * adam_v + Matrix(m, n, 1.0 - b2) * grad * grad;
-			auto adam_m_e = adam_m / Matrix(m, n, 1.0 - pow(b1, adam_t));
-			auto adam_v_e = adam_v / Matrix(m, n, 1.0 - pow(b2, adam_t));
-			//Sqrt.
-			for (auto& p : adam_v_e.data)
-				for (auto& q : p)
-					q = sqrt(q) + eps;
-			data -= Matrix(m, n, LR) * adam_m_e / adam_v_e;
+			if (grad_dense) {
+				//Update, each line in one pass without temporary matrices.
+				adam_m = b1 * lazy(adam_m) + (1.0 - b1) * lazy(grad);
+				adam_v = b2 * lazy(adam_v) + (1.0 - b2) * lazy(grad) * lazy(grad);
+				auto c1 = 1.0 - pow(b1, adam_t), c2 = 1.0 - pow(b2, adam_t);
+				data -= LR * (lazy(adam_m) / c1) / (sqrt(lazy(adam_v) / c2) + eps);
+				for (auto& p : adam_row_t)
+					++p;
+			}
+			else {
+				//Lazy Adam: only the rows with a grad are updated, and each row
+				//counts its own steps for the bias correction.
+				if (adam_row_t.size() != m)
+					adam_row_t.assign(m, adam_t - 1);
+				unique_rows(grad_rows);
+				for (auto r : grad_rows) {
+					auto t = ++adam_row_t[r];
+					auto c1 = 1.0 - pow(b1, t), c2 = 1.0 - pow(b2, t);
+					auto &g = grad.data[r], &am = adam_m.data[r], &av = adam_v.data[r];
+					for (size_t j = 0; j < n; ++j) {
+						am[j] = b1 * am[j] + (1.0 - b1) * g[j];
+						av[j] = b2 * av[j] + (1.0 - b2) * g[j] * g[j];
+						data.data[r][j] -= LR * (am[j] / c1) / (std::sqrt(av[j] / c2) + eps);
+					}
+				}
+			}
 		}
 		if (num1 and num1->requires_grad)
 			num1->Adam_optim(LR, b1, b2, visited);
 		if (num2 and num2->requires_grad)
 			num2->Adam_optim(LR, b1, b2, visited);
+		for (auto& p : inputs)
+			if (p->requires_grad)
+				p->Adam_optim(LR, b1, b2, visited);
 	}
 }
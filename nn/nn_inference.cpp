@@ -0,0 +1,304 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <future>
+#include <chrono>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------INFERENCE MODEL----------------------------
+	InferenceModel::InferenceModel(Var& output, Var& input) {
+		Var* input_node = &input.graph_data();
+		std::unordered_map<Var*, size_t> ids;
+
+		//Number the nodes in topological order.
+		std::function<size_t(Var*)> dfs = [&](Var* node) {
+			auto p = ids.find(node);
+			if (p != ids.end())
+				return p->second;
+
+			Node ans;
+			ans.op = node->op;
+			ans.op_num = node->op_num;
+			if (node->num1)
+				ans.a = dfs(node->num1.get());
+			if (node->num2)
+				ans.b = dfs(node->num2.get());
+			for (auto& p : node->inputs)
+				ans.inputs.push_back(dfs(p.get()));
+			ans.kernel = node->kernel;
+			ans.conv_kernel = node->conv_kernel;
+			//A copy, so training the graph later does not change the model.
+			if (node->norm_kernel)
+				ans.norm_kernel = std::make_shared<const NormKernel>(*node->norm_kernel);
+			//Dropout does nothing in inference.
+			if (node->dropout_kernel)
+				ans.op = Var::equals;
+			if (node == input_node) {
+				input_id = nodes.size();
+				in_shape = node->data.shape;
+			}
+			else if (node->sparse)
+				throw "Unsupported op!";
+			else if (node->op == Var::none) {
+				ans.constant = constants.size();
+				constants.push_back(node->data);
+			}
+			ids[node] = nodes.size();
+			nodes.push_back(ans);
+			return nodes.size() - 1;
+		};
+		dfs(&output.graph_data());
+		if (input_id == npos)
+			throw "The output does not depend on the input!";
+	}
+
+	std::pair<size_t, size_t> InferenceModel::input_shape() const {
+		return in_shape;
+	}
+
+	const Matrix& InferenceModel::forward(const Matrix& x, InferenceContext& ctx) const {
+		ctx.values.resize(nodes.size());
+		ctx.ptrs.resize(nodes.size());
+		for (size_t i = 0; i < nodes.size(); ++i) {
+			auto& node = nodes[i];
+			if (i == input_id)
+				ctx.ptrs[i] = &x;
+			else if (node.constant != npos)
+				ctx.ptrs[i] = &constants[node.constant];
+			else if (node.norm_kernel) {
+				node.norm_kernel->infer(*ctx.ptrs[node.a], *ctx.ptrs[node.b], ctx.values[i]);
+				ctx.ptrs[i] = &ctx.values[i];
+			}
+			else if (node.conv_kernel) {
+				node.conv_kernel->forward(node.op, *ctx.ptrs[node.a], node.b == npos ? nullptr : ctx.ptrs[node.b], ctx.values[i]);
+				ctx.ptrs[i] = &ctx.values[i];
+			}
+			else if (node.op == Var::fused) {
+				std::vector<const Matrix*> in;
+				for (auto p : node.inputs)
+					in.push_back(ctx.ptrs[p]);
+				node.kernel->forward(in, ctx.values[i]);
+				ctx.ptrs[i] = &ctx.values[i];
+			}
+			else {
+				Var::forward_kernel(node.op, node.op_num, node.a == npos ? nullptr : ctx.ptrs[node.a],
+					node.b == npos ? nullptr : ctx.ptrs[node.b], ctx.values[i]);
+				ctx.ptrs[i] = &ctx.values[i];
+			}
+		}
+		return *ctx.ptrs.back();
+	}
+
+	Matrix InferenceModel::forward(const Matrix& x) const {
+		InferenceContext ctx;
+		return forward(x, ctx);
+	}
+
+	//-------------------------BATCHING SERVER----------------------------
+	BatchingServer::BatchingServer(std::shared_ptr<const InferenceModel> model, size_t max_batch, double max_wait) :
+		model(model), max_batch(max_batch ? max_batch : 1), max_wait(max_wait), head(&stub), tail(&stub),
+		batch_sizes(this->max_batch + 1, 0) {
+		scheduler = std::thread([this] { schedule(); });
+	}
+
+	BatchingServer::~BatchingServer() {
+		{
+			std::lock_guard<std::mutex> lock(wake_mtx);
+			stop = true;
+		}
+		wake_cv.notify_one();
+		scheduler.join();
+	}
+
+	void BatchingServer::enqueue(Request* p) {
+		//The count goes up before stop is read, so the scheduler does not
+		//exit while this request is on its way.
+		++queued;
+		if (stop) {
+			--queued;
+			delete p;
+			throw "Server stopped!";
+		}
+		push(p);
+		if (sleeping) {
+			std::lock_guard<std::mutex> lock(wake_mtx);
+			wake_cv.notify_one();
+		}
+	}
+
+	void BatchingServer::push(Request* p) {
+		p->next.store(nullptr, std::memory_order_relaxed);
+		auto prev = head.exchange(p, std::memory_order_acq_rel);
+		prev->next.store(p, std::memory_order_release);
+	}
+
+	BatchingServer::Request* BatchingServer::pop() {
+		auto t = tail;
+		auto next = t->next.load(std::memory_order_acquire);
+		if (t == &stub) {
+			if (not next)
+				return nullptr;
+			tail = t = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if (next) {
+			tail = next;
+			return t;
+		}
+		//t is the last one. Put the stub behind it before taking it, unless
+		//a producer is halfway through a push.
+		if (t != head.load(std::memory_order_acquire))
+			return nullptr;
+		push(&stub);
+		next = t->next.load(std::memory_order_acquire);
+		if (next) {
+			tail = next;
+			return t;
+		}
+		return nullptr;
+	}
+
+	std::future<std::vector<double>> BatchingServer::submit(std::vector<double> x) {
+		if (x.size() != model->input_shape().second)
+			throw "Bad input size!";
+		auto p = new Request;
+		p->x = std::move(x);
+		auto ans = p->promise.get_future();
+		p->start = std::chrono::steady_clock::now();
+		enqueue(p);
+		return ans;
+	}
+
+	void BatchingServer::submit(std::vector<double> x, std::function<void(std::vector<double>)> callback) {
+		if (x.size() != model->input_shape().second)
+			throw "Bad input size!";
+		auto p = new Request;
+		p->x = std::move(x);
+		p->callback = std::move(callback);
+		p->start = std::chrono::steady_clock::now();
+		enqueue(p);
+	}
+
+	void BatchingServer::schedule() {
+		InferenceContext ctx;
+		Matrix batch;
+		std::vector<Request*> requests;
+		std::vector<double> batch_latencies;
+
+		while (true) {
+			auto first = pop();
+			if (not first) {
+				//A request that is counted but not popped is halfway through a push.
+				if (queued)
+					std::this_thread::yield();
+				else if (stop)
+					return;
+				else {
+					std::unique_lock<std::mutex> lock(wake_mtx);
+					sleeping = true;
+					wake_cv.wait(lock, [this] { return queued or stop; });
+					sleeping = false;
+				}
+				continue;
+			}
+			--queued;
+
+			//Gather until the batch is full or the first request waited long enough.
+			requests.assign(1, first);
+			auto deadline = first->start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(max_wait);
+			while (requests.size() < max_batch) {
+				if (auto p = pop()) {
+					--queued;
+					requests.push_back(p);
+				}
+				else if (stop or std::chrono::steady_clock::now() >= deadline)
+					break;
+				else
+					std::this_thread::yield();
+			}
+
+			size_t rows = requests.size(), cols = first->x.size();
+			if (batch.shape != std::make_pair(rows, cols) or batch.data.size() != rows)
+				batch = Matrix(rows, cols);
+			for (size_t i = 0; i < rows; ++i)
+				batch.data[i] = requests[i]->x;
+			const Matrix* y = nullptr;
+			std::exception_ptr error;
+			try {
+				y = &model->forward(batch, ctx);
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+
+			batch_latencies.clear();
+			for (size_t i = 0; i < rows; ++i) {
+				auto p = requests[i];
+				if (error) {
+					if (not p->callback)
+						p->promise.set_exception(error);
+				}
+				else {
+					if (p->callback)
+						try {
+							p->callback(y->data[i]);
+						}
+						catch (...) {}
+					else
+						p->promise.set_value(y->data[i]);
+					batch_latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - p->start).count());
+				}
+				delete p;
+			}
+
+			std::lock_guard<std::mutex> lock(stats_mtx);
+			latencies.insert(latencies.end(), batch_latencies.begin(), batch_latencies.end());
+			if (not error)
+				++batch_sizes[rows];
+		}
+	}
+
+	BatchingServer::Stats BatchingServer::stats() const {
+		Stats ans;
+		std::vector<double> sorted;
+		{
+			std::lock_guard<std::mutex> lock(stats_mtx);
+			sorted = latencies;
+			ans.batch_sizes = batch_sizes;
+		}
+		ans.requests = sorted.size();
+		for (auto p : ans.batch_sizes)
+			ans.batches += p;
+		if (sorted.empty())
+			return ans;
+
+		std::sort(sorted.begin(), sorted.end());
+		auto percentile = [&](double q) { return sorted[size_t(q * double(sorted.size() - 1))]; };
+		ans.p50 = percentile(0.5);
+		ans.p90 = percentile(0.9);
+		ans.p99 = percentile(0.99);
+		ans.max = sorted.back();
+		return ans;
+	}
+
+	void BatchingServer::reset_stats() {
+		std::lock_guard<std::mutex> lock(stats_mtx);
+		latencies.clear();
+		batch_sizes.assign(batch_sizes.size(), 0);
+	}
+
+	void BatchingServer::print_stats() const {
+		auto s = stats();
+		std::cout << "Requests:" << s.requests << " Batches:" << s.batches << std::endl;
+		std::cout << "Latency(us): p50=" << s.p50 << " p90=" << s.p90 << " p99=" << s.p99 << " max=" << s.max << std::endl;
+		std::cout << "Batch sizes:" << std::endl;
+		for (size_t i = 1; i < s.batch_sizes.size(); ++i)
+			if (s.batch_sizes[i])
+				std::cout << i << ":" << s.batch_sizes[i] << std::endl;
+	}
+}
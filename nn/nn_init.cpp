@@ -0,0 +1,148 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <cmath>
+#include <atomic>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------PHILOX-------------------------------------
+	namespace {
+		std::atomic<uint64_t> global_seed{ 0 }, next_stream{ 0 };
+	}
+
+	Philox::Philox(uint64_t seed, uint64_t stream) :seed(seed), stream(stream) {}
+
+	Philox Philox::next() {
+		return Philox(global_seed.load(), next_stream.fetch_add(1));
+	}
+
+	std::array<uint32_t, 4> Philox::operator()(uint64_t counter) const {
+		uint32_t c0 = uint32_t(counter), c1 = uint32_t(counter >> 32), c2 = uint32_t(stream), c3 = uint32_t(stream >> 32);
+		uint32_t k0 = uint32_t(seed), k1 = uint32_t(seed >> 32);
+		for (int round = 0; round < 10; ++round) {
+			uint64_t p0 = uint64_t(0xD2511F53u) * c0, p1 = uint64_t(0xCD9E8D57u) * c2;
+			uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0, n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+			c0 = n0, c1 = uint32_t(p1), c2 = n2, c3 = uint32_t(p0);
+			k0 += 0x9E3779B9u, k1 += 0xBB67AE85u;
+		}
+		return { c0, c1, c2, c3 };
+	}
+
+	void Philox::operator()(uint64_t counter, size_t n, uint32_t* out) const {
+		//Blocks of counters go through every round together, as arrays, so the compiler can vectorize the rounds.
+		constexpr size_t B = 64;
+		uint32_t c0[B], c1[B], c2[B], c3[B];
+		for (size_t base = 0; base < n; base += B) {
+			size_t m = std::min(B, n - base);
+			for (size_t i = 0; i < m; ++i) {
+				uint64_t c = counter + base + i;
+				c0[i] = uint32_t(c), c1[i] = uint32_t(c >> 32), c2[i] = uint32_t(stream), c3[i] = uint32_t(stream >> 32);
+			}
+			uint32_t k0 = uint32_t(seed), k1 = uint32_t(seed >> 32);
+			for (int round = 0; round < 10; ++round) {
+				for (size_t i = 0; i < m; ++i) {
+					uint64_t p0 = uint64_t(0xD2511F53u) * c0[i], p1 = uint64_t(0xCD9E8D57u) * c2[i];
+					uint32_t n0 = uint32_t(p1 >> 32) ^ c1[i] ^ k0, n2 = uint32_t(p0 >> 32) ^ c3[i] ^ k1;
+					c0[i] = n0, c1[i] = uint32_t(p1), c2[i] = n2, c3[i] = uint32_t(p0);
+				}
+				k0 += 0x9E3779B9u, k1 += 0xBB67AE85u;
+			}
+			for (size_t i = 0; i < m; ++i) {
+				auto q = out + 4 * (base + i);
+				q[0] = c0[i], q[1] = c1[i], q[2] = c2[i], q[3] = c3[i];
+			}
+		}
+	}
+
+	double Philox::uniform(uint32_t hi, uint32_t lo) {
+		return double(((uint64_t(hi) << 32) | lo) >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	void manual_seed(uint64_t seed) {
+		global_seed = seed;
+		next_stream = 0;
+	}
+
+	//-------------------------INITIALIZATION-----------------------------
+	namespace {
+		//Element i of the stream is half i % 2 of the pair made from counter i / 2,
+		//so the result does not depend on how the rows are shared between threads.
+		template<class F>
+		void fill(Matrix& w, const Philox& gen, F&& pair) {
+			size_t m = w.shape.first, n = w.shape.second;
+			auto rows = [&](size_t begin, size_t end) {
+				std::vector<uint32_t> bits;
+				for (size_t r = begin; r < end; ++r) {
+					auto& row = w.data[r];
+					uint64_t first = uint64_t(r) * n, counter = first / 2;
+					size_t counters = size_t((first + n + 1) / 2 - counter);
+					bits.resize(4 * counters);
+					gen(counter, counters, bits.data());
+					for (size_t j = 0; j < n;) {
+						uint64_t i = first + j;
+						auto values = pair(bits.data() + 4 * (i / 2 - counter));
+						for (size_t half = i % 2; half < 2 and j < n; ++half, ++j)
+							row[j] = values[half];
+					}
+				}
+			};
+			//About 64k numbers per job.
+			size_t per_job = std::max(size_t(1), (size_t(1) << 16) / std::max(size_t(1), n));
+			size_t jobs = (m + per_job - 1) / per_job;
+			if (jobs <= 1)
+				rows(0, m);
+			else
+				ThreadPool::shared().run(jobs, [&](size_t k) {
+					rows(k * per_job, std::min(m, (k + 1) * per_job));
+				});
+		}
+	}
+
+	void init_weights(Matrix& w, Init scheme, double a, double b) {
+		double fan_in = double(w.shape.first), fan_out = double(w.shape.second);
+		double mean = 0.0, range = b, stddev = b;
+		switch (scheme)
+		{
+		case Init::uniform:
+			mean = a;
+			break;
+		case Init::normal:
+			mean = a;
+			break;
+		case Init::xavier_uniform:
+			range = b * std::sqrt(6.0 / (fan_in + fan_out));
+			break;
+		case Init::xavier_normal:
+			stddev = b * std::sqrt(2.0 / (fan_in + fan_out));
+			break;
+		case Init::he_uniform:
+			range = b * std::sqrt(6.0 / fan_in);
+			break;
+		case Init::he_normal:
+			stddev = b * std::sqrt(2.0 / fan_in);
+			break;
+		}
+
+		auto gen = Philox::next();
+		if (scheme == Init::uniform or scheme == Init::xavier_uniform or scheme == Init::he_uniform)
+			fill(w, gen, [&](const uint32_t* bits) {
+				return std::array<double, 2>{
+					mean + range * (2.0 * Philox::uniform(bits[0], bits[1]) - 1.0),
+					mean + range * (2.0 * Philox::uniform(bits[2], bits[3]) - 1.0) };
+			});
+		else
+			//Box-Muller makes the two normals of a counter at once.
+			fill(w, gen, [&](const uint32_t* bits) {
+				auto u1 = 1.0 - Philox::uniform(bits[0], bits[1]), u2 = Philox::uniform(bits[2], bits[3]);
+				auto r = stddev * std::sqrt(-2.0 * std::log(u1));
+				auto t = 6.283185307179586 * u2;
+				return std::array<double, 2>{ mean + r * std::cos(t), mean + r * std::sin(t) };
+			});
+	}
+
+	void init_weights(Var& w, Init scheme, double a, double b) {
+		init_weights(w.graph_data().data, scheme, a, b);
+	}
+}
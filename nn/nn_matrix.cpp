@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <memory>
 #include <random>
+#include <algorithm>
 #include "nn.h"
 
 namespace nn {
@@ -22,77 +23,51 @@ namespace nn {
 
 	Matrix Matrix::operator+(const Matrix& rhs) const {
 		assert(rhs.shape == shape);
-		Matrix ans(shape.first, shape.second);
-		for (size_t i = 0; i < shape.first; ++i)
-			for (size_t j = 0; j < shape.second; ++j)
-				ans.data[i][j] = data[i][j] + rhs.data[i][j];
-		return ans;
+		return lazy(*this) + lazy(rhs);
 	}
 	Matrix& Matrix::operator+=(const Matrix& rhs) {
-		*this = *this + rhs;
-		return *this;
+		assert(rhs.shape == shape);
+		return *this = lazy(*this) + lazy(rhs);
 	}
 	Matrix Matrix::operator-(const Matrix& rhs) const {
 		assert(rhs.shape == shape);
-		Matrix ans(shape.first, shape.second);
-		for (size_t i = 0; i < shape.first; ++i)
-			for (size_t j = 0; j < shape.second; ++j)
-				ans.data[i][j] = data[i][j] - rhs.data[i][j];
-		return ans;
+		return lazy(*this) - lazy(rhs);
 	}
 	Matrix& Matrix::operator-=(const Matrix& rhs) {
-		*this = *this - rhs;
-		return *this;
+		assert(rhs.shape == shape);
+		return *this = lazy(*this) - lazy(rhs);
 	}
 	Matrix Matrix::operator*(const Matrix& rhs) const {
 		assert(rhs.shape == shape);
-		Matrix ans(shape.first, shape.second);
-		for (size_t i = 0; i < shape.first; ++i)
-			for (size_t j = 0; j < shape.second; ++j)
-				ans.data[i][j] = data[i][j] * rhs.data[i][j];
-		return ans;
+		return lazy(*this) * lazy(rhs);
 	}
 	Matrix& Matrix::operator*=(const Matrix& rhs) {
-		*this = *this * rhs;
-		return *this;
+		assert(rhs.shape == shape);
+		return *this = lazy(*this) * lazy(rhs);
 	}
 	Matrix Matrix::operator/(const Matrix& rhs) const {
 		assert(rhs.shape == shape);
-		Matrix ans(shape.first, shape.second);
-		for (size_t i = 0; i < shape.first; ++i)
-			for (size_t j = 0; j < shape.second; ++j)
-				ans.data[i][j] = data[i][j] / rhs.data[i][j];
-		return ans;
+		return lazy(*this) / lazy(rhs);
 	}
 	Matrix& Matrix::operator/=(const Matrix& rhs) {
-		*this = *this / rhs;
-		return *this;
+		assert(rhs.shape == shape);
+		return *this = lazy(*this) / lazy(rhs);
 	}
 	std::vector<double>& Matrix::operator[](size_t n) {
 		return data[n];
 	}
 	Matrix Matrix::relu() const {
-		Matrix ans(shape.first, shape.second);
-		for (size_t i = 0; i < shape.first; ++i) {
-			for (size_t j = 0; j < shape.second; ++j) {
-				ans.data[i][j] = data[i][j] > 0 ? data[i][j] : 0;
-			}
-		}
-		return ans;
+		return expr::relu(lazy(*this));
 	}
 
 	Matrix Matrix::matmul(const Matrix& rhs) const {
-		assert(shape.second == rhs.shape.first);
-		Matrix ans(shape.first, rhs.shape.second);
-		for (size_t i = 0; i < ans.shape.first; ++i) {
-			for (size_t j = 0; j < ans.shape.second; ++j) {
-				for (size_t k = 0; k < shape.second; ++k) {
-					ans.data[i][j] += data[i][k] * rhs.data[k][j];
-				}
-			}
-		}
+		Matrix ans;
+		matmul(rhs, ans);
 		return ans;
 	}
+	void Matrix::matmul(const Matrix& rhs, Matrix& out) const {
+		view().matmul(rhs, out);
+	}
 	Matrix Matrix::transpose() const {
 		Matrix ans(shape.second, shape.first);
 		for (size_t i = 0; i < shape.first; ++i)
@@ -131,4 +106,143 @@ namespace nn {
 	bool Matrix::empty() const {
 		return data.empty();
 	}
+	Matrix::Matrix(const MatrixView& rhs) {
+		rhs.copy_to(*this);
+	}
+	Matrix& Matrix::operator=(const MatrixView& rhs) {
+		rhs.copy_to(*this);
+		return *this;
+	}
+	MatrixView Matrix::view() const {
+		return MatrixView(*this);
+	}
+	MatrixView Matrix::rows(size_t begin, size_t end, size_t step) const {
+		return view().rows(begin, end, step);
+	}
+	MatrixView Matrix::cols(size_t begin, size_t end, size_t step) const {
+		return view().cols(begin, end, step);
+	}
+
+	//------------------------------MATRIX VIEW------------------------------
+	MatrixView::MatrixView(const Matrix& m) :m(&m), shape(m.shape) {}
+
+	MatrixView::MatrixView(const Matrix& m, size_t row_begin, size_t row_end, size_t col_begin, size_t col_end,
+		size_t row_step, size_t col_step) :
+		m(&m), row_begin(row_begin), col_begin(col_begin), row_step(row_step), col_step(col_step) {
+		if (row_step == 0 or col_step == 0 or row_begin > row_end or col_begin > col_end
+			or row_end > m.shape.first or col_end > m.shape.second)
+			throw "Bad view!";
+		shape.first = (row_end - row_begin + row_step - 1) / row_step;
+		shape.second = (col_end - col_begin + col_step - 1) / col_step;
+	}
+
+	MatrixView MatrixView::rows(size_t begin, size_t end, size_t step) const {
+		if (step == 0 or begin > end or end > shape.first)
+			throw "Bad view!";
+		auto ans = *this;
+		ans.row_begin = row_begin + begin * row_step;
+		ans.row_step = row_step * step;
+		ans.shape.first = (end - begin + step - 1) / step;
+		return ans;
+	}
+
+	MatrixView MatrixView::cols(size_t begin, size_t end, size_t step) const {
+		if (step == 0 or begin > end or end > shape.second)
+			throw "Bad view!";
+		auto ans = *this;
+		ans.col_begin = col_begin + begin * col_step;
+		ans.col_step = col_step * step;
+		ans.shape.second = (end - begin + step - 1) / step;
+		return ans;
+	}
+
+	void MatrixView::copy_to(Matrix& out) const {
+		if (&out == m) {
+			Matrix tmp;
+			copy_to(tmp);
+			out = std::move(tmp);
+			return;
+		}
+		if (out.shape != shape or out.data.size() != shape.first) {
+			out.data.assign(shape.first, std::vector<double>(shape.second));
+			out.shape = shape;
+		}
+		for (size_t i = 0; i < shape.first; ++i) {
+			auto p = row(i);
+			auto& o = out.data[i];
+			if (col_step == 1)
+				std::copy(p, p + shape.second, o.begin());
+			else
+				for (size_t j = 0; j < shape.second; ++j)
+					o[j] = p[j * col_step];
+		}
+	}
+
+	bool MatrixView::empty() const {
+		return shape.first == 0;
+	}
+
+	Matrix MatrixView::matmul(const MatrixView& rhs) const {
+		Matrix ans;
+		matmul(rhs, ans);
+		return ans;
+	}
+
+	void MatrixView::matmul(const MatrixView& rhs, Matrix& out) const {
+		assert(shape.second == rhs.shape.first);
+		//out is cleared before the operands are read.
+		if (&out == m or &out == rhs.m) {
+			Matrix tmp;
+			matmul(rhs, tmp);
+			out = std::move(tmp);
+			return;
+		}
+		if (out.shape != std::make_pair(shape.first, rhs.shape.second) or out.data.size() != shape.first)
+			out = Matrix(shape.first, rhs.shape.second);
+		else
+			out.clear();
+		//i-k-j order, so that the inner loop runs along rows. ROWS rows of the
+		//result are done together, so every row of rhs is read once for all of
+		//them. Every element still adds its products in the order of k.
+		constexpr size_t ROWS = 4;
+		size_t n = rhs.shape.second, step = rhs.col_step, i = 0;
+		for (; i + ROWS <= shape.first; i += ROWS) {
+			double* out_rows[ROWS];
+			const double* lhs_rows[ROWS];
+			for (size_t r = 0; r < ROWS; ++r)
+				out_rows[r] = out.data[i + r].data(), lhs_rows[r] = row(i + r);
+			for (size_t k = 0; k < shape.second; ++k) {
+				double a[ROWS];
+				for (size_t r = 0; r < ROWS; ++r)
+					a[r] = lhs_rows[r][k * col_step];
+				auto rhs_row = rhs.row(k);
+				if (step == 1)
+					for (size_t j = 0; j < n; ++j) {
+						auto b = rhs_row[j];
+						for (size_t r = 0; r < ROWS; ++r)
+							out_rows[r][j] += a[r] * b;
+					}
+				else
+					for (size_t j = 0; j < n; ++j) {
+						auto b = rhs_row[j * step];
+						for (size_t r = 0; r < ROWS; ++r)
+							out_rows[r][j] += a[r] * b;
+					}
+			}
+		}
+		for (; i < shape.first; ++i) {
+			auto out_row = out.data[i].data();
+			auto lhs_row = row(i);
+			for (size_t k = 0; k < shape.second; ++k) {
+				auto a = lhs_row[k * col_step];
+				auto rhs_row = rhs.row(k);
+				if (step == 1)
+					for (size_t j = 0; j < n; ++j)
+						out_row[j] += a * rhs_row[j];
+				else
+					for (size_t j = 0; j < n; ++j)
+						out_row[j] += a * rhs_row[j * step];
+			}
+		}
+	}
 }
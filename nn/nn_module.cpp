@@ -14,6 +14,10 @@ namespace nn {
 	Var Module::operator()(Var&& x) {
 		return forward(x);
 	}
+	void Module::train(bool) {}
+	void Module::eval() {
+		train(false);
+	}
 
 	Linear::Linear(size_t in_features, size_t out_features, bool bias) :
 		w(in_features, out_features, true), w_b(1, out_features, true) {
@@ -29,7 +33,29 @@ namespace nn {
 		}
 		return y;
 	}
+	bool Linear::has_bias() const {
+		return if_b;
+	}
+	Var& Linear::weight() {
+		return w;
+	}
+	Var& Linear::bias() {
+		return w_b;
+	}
 	
+	Embedding::Embedding(size_t num_embeddings, size_t embedding_dim) :
+		w(num_embeddings, embedding_dim, true) {
+		w.requires_optim = true;
+		m = num_embeddings, n = embedding_dim;
+	}
+	Var Embedding::forward(Var& x) {
+		auto y = w.embed(x);
+		return y;
+	}
+	Var& Embedding::weight() {
+		return w;
+	}
+
 	RNNCell::RNNCell(size_t in_features, size_t out_features, bool bias, bool nonlinearity) :
 		wih(in_features, out_features, true, 0.0, 1.0 / sqrt(out_features)),
 		whh(out_features, out_features, true, 0.0, 1.0 / sqrt(out_features)),
@@ -150,4 +176,35 @@ namespace nn {
 			y = mod->operator()(y);
 		return y;
 	}
+
+	void Sequential::train(bool mode) {
+		for (auto& p : seq_data)
+			p->train(mode);
+	}
+
+	void Sequential::fold_batch_norm() {
+		for (size_t i = 0; i + 1 < seq_data.size(); ++i) {
+			auto linear = dynamic_cast<Linear*>(seq_data[i].get());
+			auto bn = dynamic_cast<BatchNorm1d*>(seq_data[i + 1].get());
+			if (not linear or not bn or not linear->has_bias())
+				continue;
+
+			//bn(x * w + b) = x * (w * s) + (b - mean) * s + beta, with s = gamma / sqrt(var + eps).
+			auto& w = linear->weight().graph_data().data;
+			auto& b = linear->bias().graph_data().data;
+			auto& p = bn->w.graph_data().data;
+			auto& k = *bn->kernel;
+			for (size_t j = 0; j < w.shape.second; ++j) {
+				auto s = p.data[0][j] / std::sqrt(k.running_var[j] + k.eps);
+				for (auto& row : w.data)
+					row[j] *= s;
+				b.data[0][j] = (b.data[0][j] - k.running_mean[j]) * s + p.data[1][j];
+			}
+			seq_data.erase(seq_data.begin() + i + 1);
+		}
+	}
+
+	const std::vector<std::shared_ptr<Module>>& Sequential::layers() const {
+		return seq_data;
+	}
 }
@@ -0,0 +1,243 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <cmath>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------NORM KERNEL--------------------------------
+	namespace {
+		//Welford's algorithm over the rows, for all the columns at once.
+		void column_stats(const Matrix& x, std::vector<double>& mean, std::vector<double>& var) {
+			size_t n = x.shape.second;
+			mean.assign(n, 0.0);
+			var.assign(n, 0.0);
+			for (size_t i = 0; i < x.shape.first; ++i) {
+				auto& row = x.data[i];
+				double inv = 1.0 / double(i + 1);
+				for (size_t j = 0; j < n; ++j) {
+					auto delta = row[j] - mean[j];
+					mean[j] += delta * inv;
+					var[j] += delta * (row[j] - mean[j]);
+				}
+			}
+			if (x.shape.first)
+				for (auto& p : var)
+					p /= double(x.shape.first);
+		}
+
+		//out = (x - mean) / sqrt(var + eps) * gamma + beta, as one multiply-add per element.
+		void scale_shift(const Matrix& x, const Matrix& param, const std::vector<double>& mean,
+			const std::vector<double>& var, double eps, Matrix& out) {
+			size_t rows = x.shape.first, n = x.shape.second;
+			if (out.shape != x.shape or out.data.size() != rows)
+				out = Matrix(rows, n);
+			auto& gamma = param.data[0];
+			auto& beta = param.data[1];
+			std::vector<double> scale(n), shift(n);
+			for (size_t j = 0; j < n; ++j) {
+				scale[j] = gamma[j] / std::sqrt(var[j] + eps);
+				shift[j] = beta[j] - mean[j] * scale[j];
+			}
+			for (size_t i = 0; i < rows; ++i) {
+				auto& in = x.data[i];
+				auto& o = out.data[i];
+				for (size_t j = 0; j < n; ++j)
+					o[j] = in[j] * scale[j] + shift[j];
+			}
+		}
+
+		//Welford's algorithm over one row.
+		void row_stats(const std::vector<double>& row, double& mean, double& var) {
+			mean = var = 0.0;
+			for (size_t j = 0; j < row.size(); ++j) {
+				auto delta = row[j] - mean;
+				mean += delta / double(j + 1);
+				var += delta * (row[j] - mean);
+			}
+			if (not row.empty())
+				var /= double(row.size());
+		}
+	}
+
+	void NormKernel::forward(const Matrix& x, const Matrix& param, Matrix& out) {
+		if (not batch or not training) {
+			infer(x, param, out);
+			return;
+		}
+		size_t rows = x.shape.first, n = x.shape.second;
+		if (param.shape != std::make_pair(size_t(2), n))
+			throw "Bad input size!";
+		if (running_mean.size() != n) {
+			running_mean.assign(n, 0.0);
+			running_var.assign(n, 1.0);
+		}
+		std::vector<double> mean, var;
+		column_stats(x, mean, var);
+		//The running variance is unbiased.
+		double unbias = rows > 1 ? double(rows) / double(rows - 1) : 1.0;
+		for (size_t j = 0; j < n; ++j) {
+			running_mean[j] = (1.0 - momentum) * running_mean[j] + momentum * mean[j];
+			running_var[j] = (1.0 - momentum) * running_var[j] + momentum * var[j] * unbias;
+		}
+		scale_shift(x, param, mean, var, eps, out);
+	}
+
+	void NormKernel::infer(const Matrix& x, const Matrix& param, Matrix& out) const {
+		size_t rows = x.shape.first, n = x.shape.second;
+		if (param.shape != std::make_pair(size_t(2), n))
+			throw "Bad input size!";
+		if (out.shape != x.shape or out.data.size() != rows)
+			out = Matrix(rows, n);
+
+		if (not batch) {
+			auto& gamma = param.data[0];
+			auto& beta = param.data[1];
+			for (size_t i = 0; i < rows; ++i) {
+				double mean, var;
+				row_stats(x.data[i], mean, var);
+				auto inv_std = 1.0 / std::sqrt(var + eps);
+				auto& in = x.data[i];
+				auto& o = out.data[i];
+				for (size_t j = 0; j < n; ++j)
+					o[j] = (in[j] - mean) * inv_std * gamma[j] + beta[j];
+			}
+			return;
+		}
+
+		//Before the first training forward, the running statistics are 0 and 1.
+		if (running_mean.size() != n)
+			scale_shift(x, param, std::vector<double>(n, 0.0), std::vector<double>(n, 1.0), eps, out);
+		else
+			scale_shift(x, param, running_mean, running_var, eps, out);
+	}
+
+	void NormKernel::backward(const Matrix& x, const Matrix& param, const Matrix& grad, Matrix* x_grad, Matrix* param_grad) const {
+		size_t rows = x.shape.first, n = x.shape.second;
+		auto& gamma = param.data[0];
+
+		if (not batch) {
+			for (size_t i = 0; i < rows; ++i) {
+				double mean, var;
+				row_stats(x.data[i], mean, var);
+				auto inv_std = 1.0 / std::sqrt(var + eps);
+				auto& in = x.data[i];
+				auto& g = grad.data[i];
+				double sum_g = 0.0, sum_gx = 0.0;
+				for (size_t j = 0; j < n; ++j) {
+					auto x_hat = (in[j] - mean) * inv_std;
+					sum_g += g[j] * gamma[j];
+					sum_gx += g[j] * gamma[j] * x_hat;
+					if (param_grad) {
+						param_grad->data[0][j] += g[j] * x_hat;
+						param_grad->data[1][j] += g[j];
+					}
+				}
+				if (x_grad) {
+					auto& dx = x_grad->data[i];
+					for (size_t j = 0; j < n; ++j) {
+						auto x_hat = (in[j] - mean) * inv_std;
+						dx[j] += inv_std / double(n) * (double(n) * g[j] * gamma[j] - sum_g - x_hat * sum_gx);
+					}
+				}
+			}
+			return;
+		}
+
+		std::vector<double> mean, var;
+		if (training)
+			column_stats(x, mean, var);
+		else
+			mean = running_mean, var = running_var;
+		std::vector<double> inv_std(n), sum_g(n, 0.0), sum_gx(n, 0.0);
+		for (size_t j = 0; j < n; ++j)
+			inv_std[j] = 1.0 / std::sqrt(var[j] + eps);
+		for (size_t i = 0; i < rows; ++i) {
+			auto& in = x.data[i];
+			auto& g = grad.data[i];
+			for (size_t j = 0; j < n; ++j) {
+				sum_g[j] += g[j];
+				sum_gx[j] += g[j] * (in[j] - mean[j]) * inv_std[j];
+			}
+		}
+		if (param_grad)
+			for (size_t j = 0; j < n; ++j) {
+				param_grad->data[0][j] += sum_gx[j];
+				param_grad->data[1][j] += sum_g[j];
+			}
+		if (not x_grad)
+			return;
+
+		for (size_t i = 0; i < rows; ++i) {
+			auto& in = x.data[i];
+			auto& g = grad.data[i];
+			auto& dx = x_grad->data[i];
+			if (training)
+				for (size_t j = 0; j < n; ++j) {
+					auto x_hat = (in[j] - mean[j]) * inv_std[j];
+					dx[j] += gamma[j] * inv_std[j] / double(rows) * (double(rows) * g[j] - sum_g[j] - x_hat * sum_gx[j]);
+				}
+			else
+				for (size_t j = 0; j < n; ++j)
+					dx[j] += gamma[j] * inv_std[j] * g[j];
+		}
+	}
+
+	Var Var::norm(Var& param, const std::shared_ptr<NormKernel>& kernel) {
+		Var ans;
+		ans.op = norm_op;
+		ans.norm_kernel = kernel;
+		ans.num1 = node();
+		ans.num2 = param.node();
+		return ans;
+	}
+
+	//-------------------------NORMALIZATION LAYERS-----------------------
+	namespace {
+		//gamma = 1 and beta = 0.
+		Matrix scale_shift(size_t features) {
+			Matrix ans(2, features);
+			for (auto& p : ans.data[0])
+				p = 1.0;
+			return ans;
+		}
+	}
+
+	BatchNorm1d::BatchNorm1d(size_t features, double momentum, double eps) :
+		kernel(std::make_shared<NormKernel>()), w(scale_shift(features)) {
+		w.requires_optim = true;
+		kernel->momentum = momentum, kernel->eps = eps;
+		kernel->running_mean.assign(features, 0.0);
+		kernel->running_var.assign(features, 1.0);
+	}
+	Var BatchNorm1d::forward(Var& x) {
+		auto y = x.norm(w, kernel);
+		return y;
+	}
+	void BatchNorm1d::train(bool mode) {
+		kernel->training = mode;
+	}
+	Var& BatchNorm1d::weight() {
+		return w;
+	}
+	const std::vector<double>& BatchNorm1d::running_mean() const {
+		return kernel->running_mean;
+	}
+	const std::vector<double>& BatchNorm1d::running_var() const {
+		return kernel->running_var;
+	}
+
+	LayerNorm::LayerNorm(size_t features, double eps) :
+		kernel(std::make_shared<NormKernel>()), w(scale_shift(features)) {
+		w.requires_optim = true;
+		kernel->batch = false, kernel->eps = eps;
+	}
+	Var LayerNorm::forward(Var& x) {
+		auto y = x.norm(w, kernel);
+		return y;
+	}
+	Var& LayerNorm::weight() {
+		return w;
+	}
+}
@@ -0,0 +1,632 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <algorithm>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------THREAD POOL--------------------------------
+	ThreadPool::ThreadPool(size_t n_threads) {
+		for (size_t i = 1; i < n_threads; ++i) {
+			workers.emplace_back([this] {
+				size_t seen = 0;
+				while (true) {
+					std::unique_lock<std::mutex> lock(mtx);
+					cv.wait(lock, [&] { return stop or generation != seen; });
+					if (stop)
+						return;
+					seen = generation;
+					++busy;
+					lock.unlock();
+
+					work();
+
+					lock.lock();
+					if (--busy == 0)
+						done_cv.notify_all();
+				}
+			});
+		}
+	}
+
+	ThreadPool::~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		for (auto& p : workers)
+			p.join();
+	}
+
+	size_t ThreadPool::size() const {
+		return workers.size() + 1;
+	}
+
+	namespace {
+		//The pool whose job the current thread is running.
+		thread_local const ThreadPool* current_pool = nullptr;
+	}
+
+	ThreadPool& ThreadPool::shared() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	void ThreadPool::work() {
+		auto last = current_pool;
+		current_pool = this;
+		for (size_t i; (i = next.fetch_add(1)) < job_n;) {
+			if (not failed)
+				try {
+					(*job)(i);
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(mtx);
+					if (not error)
+						error = std::current_exception();
+					failed = true;
+				}
+			if (pending.fetch_sub(1) == 1) {
+				std::lock_guard<std::mutex> lock(mtx);
+				done_cv.notify_all();
+			}
+		}
+		current_pool = last;
+	}
+
+	void ThreadPool::run(size_t n, const std::function<void(size_t)>& fn) {
+		if (n == 0)
+			return;
+		//A job of this pool that starts another one runs it by itself.
+		std::unique_lock<std::mutex> running(run_mtx, std::defer_lock);
+		if (workers.empty() or n == 1 or current_pool == this or not running.try_lock()) {
+			for (size_t i = 0; i < n; ++i)
+				fn(i);
+			return;
+		}
+
+		{
+			//Wait for the late workers of the last job before changing it.
+			std::unique_lock<std::mutex> lock(mtx);
+			done_cv.wait(lock, [this] { return busy == 0; });
+			job = &fn;
+			job_n = n;
+			next = 0;
+			pending = n;
+			failed = false;
+			++generation;
+		}
+		cv.notify_all();
+
+		work();
+
+		std::unique_lock<std::mutex> lock(mtx);
+		done_cv.wait(lock, [this] { return pending == 0 and busy == 0; });
+		if (error) {
+			auto e = error;
+			error = nullptr;
+			std::rethrow_exception(e);
+		}
+	}
+
+	//-------------------------DATA PARALLEL------------------------------
+	DataParallel::DataParallel(size_t n_workers, const std::function<Var(Var&, Var&)>& build) :
+		replicas(n_workers ? n_workers : 1), pool(n_workers ? n_workers : 1) {
+		for (auto& r : replicas) {
+			r.loss = build(r.x, r.y);
+			r.params = r.loss.parameters();
+			if (r.params.size() != replicas.front().params.size())
+				throw "Replicas do not match!";
+		}
+		broadcast_parameters();
+	}
+
+	size_t DataParallel::size() const {
+		return replicas.size();
+	}
+
+	Var& DataParallel::loss() {
+		return replicas.front().loss;
+	}
+
+	void DataParallel::broadcast_parameters() {
+		auto& src = replicas.front().params;
+		pool.run(replicas.size() - 1, [&](size_t k) {
+			auto& dst = replicas[k + 1].params;
+			for (size_t p = 0; p < src.size(); ++p)
+				dst[p]->data = src[p]->data;
+		});
+	}
+
+	double DataParallel::step(const Matrix& x, const Matrix& y, Var::Optim func, double LR) {
+		assert(x.shape.first == y.shape.first);
+		size_t batch = x.shape.first;
+		size_t active = std::min(replicas.size(), batch);
+		if (active == 0)
+			return 0.0;
+
+		//Forward and backward on every shard. The gradients are scaled by the
+		//size of the shard so that their sum is the gradient of the full batch.
+		std::vector<double> losses(active, 0.0);
+		pool.run(active, [&](size_t k) {
+			auto& r = replicas[k];
+			size_t begin = batch * k / active, end = batch * (k + 1) / active;
+			double scale = double(end - begin) / double(batch);
+
+			r.x.set_data(x.rows(begin, end));
+			r.y.set_data(y.rows(begin, end));
+			r.loss.calculate();
+			r.loss.zero_grad();
+			r.loss.backward();
+
+			for (auto p : r.params)
+				for (auto& row : p->grad.data)
+					for (auto& q : row)
+						q *= scale;
+			losses[k] = r.loss.graph_data().data.data[0][0] * scale;
+		});
+
+		//Tree all-reduce into the first replica.
+		for (size_t stride = 1; stride < active; stride <<= 1) {
+			size_t pairs = (active - stride + 2 * stride - 1) / (2 * stride);
+			pool.run(pairs, [&](size_t i) {
+				auto& dst = replicas[2 * stride * i].params;
+				auto& src = replicas[2 * stride * i + stride].params;
+				for (size_t p = 0; p < dst.size(); ++p) {
+					auto& a = dst[p]->grad;
+					auto& b = src[p]->grad;
+					dst[p]->grad_dense = true;
+					for (size_t r = 0; r < a.shape.first; ++r)
+						for (size_t c = 0; c < a.shape.second; ++c)
+							a.data[r][c] += b.data[r][c];
+				}
+			});
+		}
+
+		replicas.front().loss.optim(func, LR);
+		broadcast_parameters();
+
+		double total = 0.0;
+		for (auto p : losses)
+			total += p;
+		return total;
+	}
+
+	//-------------------------HOGWILD------------------------------------
+	Hogwild::Hogwild(size_t n_threads, const std::function<Var(Var&, Var&)>& build) :
+		replicas(n_threads ? n_threads : 1), pool(n_threads ? n_threads : 1) {
+		for (auto& r : replicas) {
+			r.loss = build(r.x, r.y);
+			r.params = r.loss.parameters();
+			if (r.params.size() != replicas.front().params.size())
+				throw "Replicas do not match!";
+			for (auto p : r.params)
+				r.velocity.emplace_back(p->data.shape.first, p->data.shape.second);
+		}
+
+		for (auto p : replicas.front().params) {
+			size_t m = p->data.shape.first, n = p->data.shape.second;
+			shared.emplace_back(new std::atomic<double>[m * n]);
+			for (size_t i = 0; i < m; ++i)
+				for (size_t j = 0; j < n; ++j)
+					shared.back()[i * n + j].store(p->data.data[i][j], std::memory_order_relaxed);
+		}
+		for (auto& r : replicas)
+			pull(r);
+	}
+
+	size_t Hogwild::size() const {
+		return replicas.size();
+	}
+
+	Var& Hogwild::loss() {
+		return replicas.front().loss;
+	}
+
+	void Hogwild::pull(Replica& r) {
+		for (size_t k = 0; k < r.params.size(); ++k) {
+			auto& data = r.params[k]->data;
+			auto buf = shared[k].get();
+			for (size_t i = 0; i < data.shape.first; ++i)
+				for (size_t j = 0; j < data.shape.second; ++j)
+					data.data[i][j] = buf[i * data.shape.second + j].load(std::memory_order_relaxed);
+		}
+	}
+
+	void Hogwild::train(const Matrix& x, const Matrix& y, size_t batch_size, size_t steps, double LR) {
+		assert(x.shape.first == y.shape.first);
+		size_t rows = x.shape.first, threads = std::min(replicas.size(), rows);
+		if (threads == 0 or batch_size == 0)
+			return;
+
+		pool.run(threads, [&](size_t t) {
+			auto& r = replicas[t];
+			size_t begin = rows * t / threads, end = rows * (t + 1) / threads;
+			size_t cur = begin, since_pull = 0;
+			for (size_t step = 0; step < steps; ++step) {
+				if (++since_pull >= max_staleness) {
+					pull(r);
+					since_pull = 0;
+				}
+
+				//Take the next batch_size rows of the part, wrapping around.
+				size_t n = std::min(batch_size, end - begin);
+				if (cur + n <= end) {
+					r.x.set_data(x.rows(cur, cur + n));
+					r.y.set_data(y.rows(cur, cur + n));
+					cur = cur + n == end ? begin : cur + n;
+				}
+				else {
+					std::vector<std::vector<double>> bx, by;
+					for (size_t i = 0; i < n; ++i) {
+						bx.push_back(x.data[cur]);
+						by.push_back(y.data[cur]);
+						if (++cur == end)
+							cur = begin;
+					}
+					r.x.set_data(Matrix(bx));
+					r.y.set_data(Matrix(by));
+				}
+				r.loss.calculate();
+				r.loss.zero_grad();
+				r.loss.backward();
+
+				for (size_t k = 0; k < r.params.size(); ++k) {
+					auto& p = *r.params[k];
+					auto& v = r.velocity[k];
+					auto buf = shared[k].get();
+					size_t n = p.data.shape.second;
+					for (size_t i = 0; i < p.data.shape.first; ++i)
+						for (size_t j = 0; j < n; ++j) {
+							double u = momentum * v.data[i][j] + p.grad.data[i][j];
+							v.data[i][j] = u;
+							p.data.data[i][j] -= LR * u;
+							auto& q = buf[i * n + j];
+							q.store(q.load(std::memory_order_relaxed) - LR * u, std::memory_order_relaxed);
+						}
+				}
+			}
+		});
+
+		pull(replicas.front());
+	}
+
+	//-------------------------GRADIENT ACCUMULATION----------------------
+	GradientAccumulator::GradientAccumulator(size_t micro_batch, const std::function<Var(Var&, Var&)>& build) :
+		micro_batch(micro_batch ? micro_batch : 1) {
+		loss_ = build(x, y);
+		params = loss_.parameters();
+		for (auto p : params)
+			acc.emplace_back(p->data.shape.first, p->data.shape.second);
+	}
+
+	Var& GradientAccumulator::loss() {
+		return loss_;
+	}
+
+	double GradientAccumulator::step(const Matrix& x, const Matrix& y, Var::Optim func, double LR) {
+		assert(x.shape.first == y.shape.first);
+		size_t batch = x.shape.first;
+		size_t n_micro = (batch + micro_batch - 1) / micro_batch;
+		return step(n_micro, [&](size_t k, Matrix& bx, Matrix& by) {
+			size_t begin = k * micro_batch, end = std::min(batch, begin + micro_batch);
+			bx = x.rows(begin, end);
+			by = y.rows(begin, end);
+		}, func, LR);
+	}
+
+	double GradientAccumulator::step(size_t n_micro, const std::function<void(size_t, Matrix&, Matrix&)>& load,
+		Var::Optim func, double LR) {
+		if (n_micro == 0)
+			return 0.0;
+		for (auto& p : acc)
+			p.clear();
+
+		//Two buffers: one is trained on while the other is loaded.
+		Matrix bx[2], by[2];
+		std::future<void> next;
+		load(0, bx[0], by[0]);
+		double total = 0.0;
+		size_t rows = 0;
+		for (size_t k = 0; k < n_micro; ++k) {
+			auto& cx = bx[k % 2];
+			auto& cy = by[k % 2];
+			if (k > 0) {
+				if (overlap)
+					next.get();
+				else
+					load(k, cx, cy);
+			}
+			if (overlap and k + 1 < n_micro)
+				next = std::async(std::launch::async, [&, k] { load(k + 1, bx[(k + 1) % 2], by[(k + 1) % 2]); });
+
+			//The loss is a mean over the micro-batch, so its grads are weighted by the rows.
+			double n = double(cx.shape.first);
+			x.set_data(cx);
+			y.set_data(cy);
+			loss_.calculate();
+			loss_.zero_grad();
+			loss_.backward();
+			for (size_t p = 0; p < params.size(); ++p) {
+				auto& a = acc[p];
+				auto& g = params[p]->grad;
+				for (size_t i = 0; i < a.shape.first; ++i)
+					for (size_t j = 0; j < a.shape.second; ++j)
+						a.data[i][j] += n * g.data[i][j];
+			}
+			total += n * loss_.graph_data().data.data[0][0];
+			rows += cx.shape.first;
+		}
+
+		double inv = rows ? 1.0 / double(rows) : 0.0;
+		for (size_t p = 0; p < params.size(); ++p) {
+			auto& g = params[p]->grad;
+			for (size_t i = 0; i < g.shape.first; ++i)
+				for (size_t j = 0; j < g.shape.second; ++j)
+					g.data[i][j] = acc[p].data[i][j] * inv;
+			params[p]->grad_rows.clear();
+			params[p]->grad_dense = true;
+		}
+		loss_.optim(func, LR);
+		return total * inv;
+	}
+
+	//-------------------------PIPELINE-----------------------------------
+	namespace {
+		//Thrown by a Channel when another stage failed.
+		struct Aborted {};
+	}
+
+	//A bounded lock-free queue with one producer and one consumer.
+	//A side that cannot go on spins for a while, then sleeps until the
+	//other side or an abort wakes it.
+	struct Pipeline::Channel {
+		static constexpr int SPINS = 64;
+		std::vector<Matrix> slots;
+		std::atomic<size_t> head{ 0 }, tail{ 0 };
+		std::atomic<int> sleepers{ 0 };
+		std::mutex mtx;
+		std::condition_variable cv;
+		const std::atomic<bool>& aborted;
+
+		Channel(size_t capacity, const std::atomic<bool>& aborted) :slots(capacity), aborted(aborted) {}
+		//Wait until ready() is true.
+		template<class F>
+		void wait(const F& ready) {
+			for (int i = 0; i < SPINS; ++i) {
+				if (ready())
+					return;
+				if (aborted)
+					throw Aborted();
+				std::this_thread::yield();
+			}
+			std::unique_lock<std::mutex> lock(mtx);
+			++sleepers;
+			cv.wait(lock, [&] { return ready() or aborted; });
+			--sleepers;
+			if (not ready())
+				throw Aborted();
+		}
+		//Wake the other side if it sleeps. sleepers is read after the index
+		//is stored, and both are sequentially consistent, so a wake-up is not lost.
+		void wake() {
+			if (sleepers) {
+				std::lock_guard<std::mutex> lock(mtx);
+				cv.notify_all();
+			}
+		}
+		void push(Matrix&& m) {
+			auto t = tail.load(std::memory_order_relaxed);
+			wait([&] { return t - head.load() < slots.size(); });
+			slots[t % slots.size()] = std::move(m);
+			tail.store(t + 1);
+			wake();
+		}
+		Matrix pop() {
+			auto h = head.load(std::memory_order_relaxed);
+			wait([&] { return tail.load() != h; });
+			auto ans = std::move(slots[h % slots.size()]);
+			head.store(h + 1);
+			wake();
+			return ans;
+		}
+		void reset() {
+			for (auto& p : slots)
+				p = Matrix();
+			head = tail = 0;
+		}
+	};
+
+	Pipeline::Pipeline(Sequential& net, const std::vector<size_t>& stage_sizes, size_t micro_batch,
+		const std::function<Var(Var&, Var&)>& loss) :
+		micro_batch(micro_batch ? micro_batch : 1), pool(stage_sizes.empty() ? 1 : stage_sizes.size()) {
+		build(net, stage_sizes, loss);
+	}
+
+	Pipeline::~Pipeline() {}
+
+	void Pipeline::build(Sequential& net, const std::vector<size_t>& stage_sizes, const std::function<Var(Var&, Var&)>& loss) {
+		auto& layers = net.layers();
+		size_t total = 0;
+		for (auto p : stage_sizes)
+			total += p;
+		if (stage_sizes.empty() or total != layers.size())
+			throw "Bad stage sizes!";
+
+		size_t n = stage_sizes.size(), first = 0;
+		stages.resize(n);
+		for (size_t s = 0; s < n; ++s) {
+			//1F1B keeps at most n - s micro-batches in flight at stage s.
+			auto& st = stages[s];
+			st.replicas.resize(n - s);
+			for (auto& rep : st.replicas) {
+				rep.in.requires_grad = s > 0;
+				rep.y.requires_grad = false;
+				auto h = std::move(rep.in);
+				for (size_t i = first; i < first + stage_sizes[s]; ++i)
+					h = layers[i]->operator()(h);
+				if (s + 1 == n) {
+					rep.pred = h;
+					rep.out = loss(h, rep.y);
+				}
+				else
+					rep.out = h;
+			}
+			first += stage_sizes[s];
+			st.params = st.replicas.front().out.parameters();
+			for (auto p : st.params)
+				st.acc.emplace_back(p->data.shape.first, p->data.shape.second);
+			if (s + 1 < n) {
+				forward_queues.emplace_back(new Channel(n + 1, aborted));
+				backward_queues.emplace_back(new Channel(n + 1, aborted));
+			}
+		}
+	}
+
+	size_t Pipeline::size() const {
+		return stages.size();
+	}
+
+	void Pipeline::run_stages(const std::function<void(size_t)>& stage) {
+		//The stages wait for each other, so they must all run at the same time
+		//on the threads of the pool.
+		if (running.exchange(true))
+			throw "Pipeline is busy!";
+		std::exception_ptr error;
+		std::mutex error_mtx;
+		pool.run(stages.size(), [&](size_t s) {
+			try {
+				stage(s);
+			}
+			catch (const Aborted&) {}
+			catch (...) {
+				{
+					std::lock_guard<std::mutex> lock(error_mtx);
+					if (not error)
+						error = std::current_exception();
+				}
+				aborted = true;
+				for (auto& p : forward_queues)
+					p->wake();
+				for (auto& p : backward_queues)
+					p->wake();
+			}
+		});
+		if (error) {
+			for (auto& p : forward_queues)
+				p->reset();
+			for (auto& p : backward_queues)
+				p->reset();
+			aborted = false;
+		}
+		running = false;
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	namespace {
+		MatrixView slice_rows(const Matrix& x, size_t begin, size_t end) {
+			return x.rows(begin, std::min(end, x.shape.first));
+		}
+	}
+
+	double Pipeline::step(const Matrix& x, const Matrix& y, Var::Optim func, double LR) {
+		assert(x.shape.first == y.shape.first);
+		size_t batch = x.shape.first, n_micro = (batch + micro_batch - 1) / micro_batch;
+		if (n_micro == 0)
+			return 0.0;
+
+		double total = 0.0;
+		run_stages([&](size_t s) {
+			auto& st = stages[s];
+			bool last = s + 1 == stages.size();
+			size_t in_flight = st.replicas.size(), f = 0, b = 0;
+			for (auto& p : st.acc)
+				p.clear();
+			while (b < n_micro) {
+				if (f < n_micro and f - b < in_flight) {
+					auto& rep = st.replicas[f % in_flight];
+					if (s == 0)
+						rep.in.set_data(slice_rows(x, f * micro_batch, (f + 1) * micro_batch));
+					else
+						rep.in.set_data(forward_queues[s - 1]->pop());
+					if (last)
+						rep.y.set_data(slice_rows(y, f * micro_batch, (f + 1) * micro_batch));
+					rep.out.calculate();
+					if (not last)
+						forward_queues[s]->push(Matrix(rep.out.graph_data().data));
+					++f;
+					continue;
+				}
+
+				//The loss is a mean over the micro-batch, so its grads are weighted by the rows.
+				auto& rep = st.replicas[b % in_flight];
+				double rows = double(rep.in.shape().first);
+				rep.out.zero_grad();
+				if (last) {
+					rep.out.backward();
+					total += rows * rep.out.graph_data().data.data[0][0];
+				}
+				else
+					rep.out.backward(backward_queues[s]->pop());
+				for (size_t p = 0; p < st.params.size(); ++p) {
+					auto& a = st.acc[p];
+					auto& g = st.params[p]->grad;
+					for (size_t i = 0; i < a.shape.first; ++i)
+						for (size_t j = 0; j < a.shape.second; ++j)
+							a.data[i][j] += rows * g.data[i][j];
+				}
+				if (s > 0)
+					backward_queues[s - 1]->push(Matrix(rep.in.graph_data().grad));
+				++b;
+			}
+
+			for (size_t p = 0; p < st.params.size(); ++p) {
+				auto& g = st.params[p]->grad;
+				for (size_t i = 0; i < g.shape.first; ++i)
+					for (size_t j = 0; j < g.shape.second; ++j)
+						g.data[i][j] = st.acc[p].data[i][j] / double(batch);
+				st.params[p]->grad_rows.clear();
+				st.params[p]->grad_dense = true;
+			}
+			st.replicas.front().out.optim(func, LR);
+		});
+		return total / double(batch);
+	}
+
+	Matrix Pipeline::forward(const Matrix& x) {
+		size_t batch = x.shape.first, n_micro = (batch + micro_batch - 1) / micro_batch;
+		std::vector<std::vector<double>> ans;
+		run_stages([&](size_t s) {
+			auto& st = stages[s];
+			bool last = s + 1 == stages.size();
+			//The replicas share the layers, so this switches all of them.
+			TrainModeGuard eval(st.replicas.front().out, false);
+			for (size_t f = 0; f < n_micro; ++f) {
+				auto& rep = st.replicas[f % st.replicas.size()];
+				if (s == 0)
+					rep.in.set_data(slice_rows(x, f * micro_batch, (f + 1) * micro_batch));
+				else
+					rep.in.set_data(forward_queues[s - 1]->pop());
+				if (last) {
+					rep.pred.calculate();
+					auto& out = rep.pred.graph_data().data.data;
+					ans.insert(ans.end(), out.begin(), out.end());
+				}
+				else {
+					rep.out.calculate();
+					forward_queues[s]->push(Matrix(rep.out.graph_data().data));
+				}
+			}
+		});
+		return ans.empty() ? Matrix() : Matrix(ans);
+	}
+}
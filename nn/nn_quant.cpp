@@ -0,0 +1,308 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define NN_AVX2_DISPATCH
+#endif
+#include "nn.h"
+
+namespace nn {
+	//-------------------------INT8 KERNELS-------------------------------
+	namespace {
+		//The products of int8 fit in int16, so the compiler can use 16-bit
+		//multiply-adds for this loop on any SSE2 machine.
+		int32_t dot_s8(const int8_t* a, const int8_t* b, size_t k) {
+			int32_t ans = 0;
+			for (size_t i = 0; i < k; ++i)
+				ans += int16_t(a[i]) * int16_t(b[i]);
+			return ans;
+		}
+
+		void accumulate_s8(const int8_t* x, const int8_t* w, size_t rows, size_t m, size_t n, int32_t* out) {
+			for (size_t r = 0; r < rows; ++r)
+				for (size_t j = 0; j < n; ++j)
+					out[r * n + j] = dot_s8(x + r * m, w + j * m, m);
+		}
+
+#if defined(NN_AVX2_DISPATCH)
+		__attribute__((target("avx2")))
+		int32_t hsum_avx2(__m256i x) {
+			auto sum = _mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+			sum = _mm_hadd_epi32(sum, sum);
+			sum = _mm_hadd_epi32(sum, sum);
+			return _mm_cvtsi128_si32(sum);
+		}
+
+		//Built for AVX2 whatever the flags are, and only called when the CPU has it.
+		//Four columns share each load of the row.
+		__attribute__((target("avx2")))
+		void accumulate_s8_avx2(const int8_t* x, const int8_t* w, size_t rows, size_t m, size_t n, int32_t* out) {
+			size_t full = m / 16 * 16;
+			for (size_t r = 0; r < rows; ++r) {
+				auto a = x + r * m;
+				size_t j = 0;
+				for (; j + 4 <= n; j += 4) {
+					auto b = w + j * m;
+					__m256i acc[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+					for (size_t i = 0; i < full; i += 16) {
+						auto va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+						for (size_t c = 0; c < 4; ++c) {
+							auto vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + c * m + i)));
+							acc[c] = _mm256_add_epi32(acc[c], _mm256_madd_epi16(va, vb));
+						}
+					}
+					for (size_t c = 0; c < 4; ++c)
+						out[r * n + j + c] = hsum_avx2(acc[c]) + dot_s8(a + full, b + c * m + full, m - full);
+				}
+				for (; j < n; ++j) {
+					auto b = w + j * m;
+					__m256i acc = _mm256_setzero_si256();
+					for (size_t i = 0; i < full; i += 16) {
+						auto va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+						auto vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+						acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+					}
+					out[r * n + j] = hsum_avx2(acc) + dot_s8(a + full, b + full, m - full);
+				}
+			}
+		}
+
+		const bool has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+		int8_t saturate(double x) {
+			return int8_t(std::max(-127.0, std::min(127.0, std::nearbyint(x))));
+		}
+
+		double max_abs(const Matrix& x) {
+			double ans = 0.0;
+			for (auto& p : x.data)
+				for (auto q : p)
+					ans = std::max(ans, std::abs(q));
+			return ans;
+		}
+
+		double sigmoid(double x) {
+			return 1.0 / (1.0 + std::exp(-x));
+		}
+
+		//Join the columns of several matrices with the same number of rows.
+		Matrix concat_cols(const std::vector<Matrix>& parts) {
+			size_t cols = 0;
+			for (auto& p : parts)
+				cols += p.shape.second;
+			Matrix ans(parts.front().shape.first, cols);
+			for (size_t i = 0; i < ans.shape.first; ++i) {
+				size_t j = 0;
+				for (auto& p : parts)
+					for (auto q : p.data[i])
+						ans.data[i][j++] = q;
+			}
+			return ans;
+		}
+	}
+
+	//-------------------------QUANTIZED LINEAR---------------------------
+	QuantizedLinear::QuantizedLinear(Linear& layer, double input_range) :
+		QuantizedLinear(layer.weight().graph_data().data,
+			layer.has_bias() ? layer.bias().graph_data().data : Matrix(), input_range) {}
+
+	QuantizedLinear::QuantizedLinear(const Matrix& weight, const Matrix& bias, double input_range) :
+		m(weight.shape.first), n(weight.shape.second), w(m * n), w_scale(n, 1.0), b(n, 0.0) {
+		for (size_t j = 0; j < n; ++j) {
+			double range = 0.0;
+			for (size_t i = 0; i < m; ++i)
+				range = std::max(range, std::abs(weight.data[i][j]));
+			if (range > 0.0)
+				w_scale[j] = range / 127.0;
+			for (size_t i = 0; i < m; ++i)
+				w[j * m + i] = saturate(weight.data[i][j] / w_scale[j]);
+			if (not bias.empty())
+				b[j] = bias.data[0][j];
+		}
+		if (input_range > 0.0)
+			x_scale = input_range / 127.0;
+	}
+
+	std::vector<int8_t> QuantizedLinear::quantize(const Matrix& x) const {
+		assert(x.shape.second == m);
+		std::vector<int8_t> ans(x.shape.first * m);
+		auto inv = 1.0 / x_scale;
+		for (size_t r = 0; r < x.shape.first; ++r)
+			for (size_t i = 0; i < m; ++i)
+				ans[r * m + i] = saturate(x.data[r][i] * inv);
+		return ans;
+	}
+
+	std::vector<int32_t> QuantizedLinear::accumulate(const std::vector<int8_t>& x, size_t rows) const {
+		assert(x.size() == rows * m);
+		std::vector<int32_t> ans(rows * n);
+#if defined(NN_AVX2_DISPATCH)
+		if (has_avx2) {
+			accumulate_s8_avx2(x.data(), w.data(), rows, m, n, ans.data());
+			return ans;
+		}
+#endif
+		accumulate_s8(x.data(), w.data(), rows, m, n, ans.data());
+		return ans;
+	}
+
+	Matrix QuantizedLinear::forward(const Matrix& x) const {
+		size_t rows = x.shape.first;
+		auto acc = accumulate(quantize(x), rows);
+		Matrix ans(rows, n);
+		for (size_t r = 0; r < rows; ++r)
+			for (size_t j = 0; j < n; ++j)
+				ans.data[r][j] = acc[r * n + j] * x_scale * w_scale[j] + b[j];
+		return ans;
+	}
+
+	//-------------------------QUANTIZED LSTM-----------------------------
+	QuantizedLSTM::QuantizedLSTM(LSTM& layer, double input_range) :m(layer.m), n(layer.n) {
+		auto x_w = concat_cols({ layer.w_ii.graph_data().data, layer.w_if.graph_data().data,
+			layer.w_ig.graph_data().data, layer.w_io.graph_data().data });
+		auto h_w = concat_cols({ layer.w_hi.graph_data().data, layer.w_hf.graph_data().data,
+			layer.w_hg.graph_data().data, layer.w_ho.graph_data().data });
+		Matrix b;
+		if (layer.if_b)
+			b = concat_cols({ layer.b_i.graph_data().data, layer.b_f.graph_data().data,
+				layer.b_g.graph_data().data, layer.b_o.graph_data().data });
+		x_gates = QuantizedLinear(x_w, b, input_range);
+		//The hidden state is o * tanh(c), which is always in [-1, 1].
+		h_gates = QuantizedLinear(h_w, Matrix(), 1.0);
+	}
+
+	void QuantizedLSTM::init(size_t batch_size) {
+		h_s = Matrix(batch_size, n);
+		c_s = Matrix(batch_size, n);
+	}
+
+	Matrix QuantizedLSTM::forward(const Matrix& x) {
+		size_t rows = x.shape.first;
+		if (h_s.shape.first != rows)
+			init(rows);
+
+		auto gx = x_gates.forward(x);
+		auto gh = h_gates.forward(h_s);
+		for (size_t r = 0; r < rows; ++r)
+			for (size_t j = 0; j < n; ++j) {
+				auto i_t = sigmoid(gx.data[r][j] + gh.data[r][j]);
+				auto f_t = sigmoid(gx.data[r][n + j] + gh.data[r][n + j]);
+				auto g_t = std::tanh(gx.data[r][2 * n + j] + gh.data[r][2 * n + j]);
+				auto o_t = sigmoid(gx.data[r][3 * n + j] + gh.data[r][3 * n + j]);
+				c_s.data[r][j] = f_t * c_s.data[r][j] + i_t * g_t;
+				h_s.data[r][j] = o_t * std::tanh(c_s.data[r][j]);
+			}
+		return h_s;
+	}
+
+	//-------------------------QUANTIZED SEQUENTIAL-----------------------
+	QuantizedSequential::QuantizedSequential(Sequential& net, const Matrix& calibration_data) {
+		//Run the fp64 net on the calibration data to find the input range of every Linear.
+		auto cur = calibration_data;
+		for (auto& p : net.layers()) {
+			if (auto layer = dynamic_cast<Linear*>(p.get())) {
+				ops.push_back(linear);
+				linears.emplace_back(*layer, max_abs(cur));
+				cur = cur.matmul(layer->weight().graph_data().data);
+				if (layer->has_bias()) {
+					auto& b = layer->bias().graph_data().data;
+					for (auto& row : cur.data)
+						for (size_t j = 0; j < row.size(); ++j)
+							row[j] += b.data[0][j];
+				}
+			}
+			else if (dynamic_cast<ReLU*>(p.get())) {
+				ops.push_back(re);
+				cur = cur.relu();
+			}
+			else if (dynamic_cast<TanH*>(p.get())) {
+				ops.push_back(th);
+				for (auto& row : cur.data)
+					for (auto& q : row)
+						q = std::tanh(q);
+			}
+			else if (dynamic_cast<Sigmoid*>(p.get())) {
+				ops.push_back(sig);
+				for (auto& row : cur.data)
+					for (auto& q : row)
+						q = sigmoid(q);
+			}
+			//Dropout does nothing in inference.
+			else if (dynamic_cast<Dropout*>(p.get()))
+				continue;
+			else
+				throw "Unsupported layer!";
+		}
+	}
+
+	Matrix QuantizedSequential::forward(const Matrix& x) const {
+		size_t rows = x.shape.first, k = 0;
+		auto cur = x;
+		std::vector<int8_t> q;
+		bool quantized = false;
+
+		for (size_t i = 0; i < ops.size(); ++i) {
+			switch (ops[i])
+			{
+			case linear: {
+				auto& layer = linears[k++];
+				auto acc = layer.accumulate(quantized ? q : layer.quantize(cur), rows);
+
+				//Requantize for the next Linear, with the ReLU between them as a clamp.
+				size_t nxt = i + 1;
+				bool relu = nxt < ops.size() and ops[nxt] == re;
+				if (relu)
+					++nxt;
+				if (nxt < ops.size() and ops[nxt] == linear) {
+					auto inv = 1.0 / linears[k].x_scale;
+					q.resize(rows * layer.n);
+					for (size_t r = 0; r < rows; ++r)
+						for (size_t j = 0; j < layer.n; ++j) {
+							auto v = acc[r * layer.n + j] * layer.x_scale * layer.w_scale[j] + layer.b[j];
+							q[r * layer.n + j] = saturate((relu ? std::max(v, 0.0) : v) * inv);
+						}
+					quantized = true;
+					i = nxt - 1;
+					break;
+				}
+
+				cur = Matrix(rows, layer.n);
+				for (size_t r = 0; r < rows; ++r)
+					for (size_t j = 0; j < layer.n; ++j)
+						cur.data[r][j] = acc[r * layer.n + j] * layer.x_scale * layer.w_scale[j] + layer.b[j];
+				quantized = false;
+			}
+				break;
+			case re:
+				cur = cur.relu();
+				break;
+			case th:
+				for (auto& row : cur.data)
+					for (auto& p : row)
+						p = std::tanh(p);
+				break;
+			case sig:
+				for (auto& row : cur.data)
+					for (auto& p : row)
+						p = sigmoid(p);
+				break;
+			default:
+				break;
+			}
+		}
+		return cur;
+	}
+
+	size_t QuantizedSequential::weight_bytes() const {
+		size_t ans = 0;
+		for (auto& p : linears)
+			ans += p.w.size() * sizeof(int8_t) + (p.w_scale.size() + p.b.size()) * sizeof(double);
+		return ans;
+	}
+}
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------REDUCTION----------------------------------
+	namespace {
+		//The block size fixes the order of the additions, so it must not
+		//depend on the number of threads.
+		constexpr size_t BLOCK = 4096, LANES = 8, PARALLEL = 1 << 16;
+
+		//Neumaier's summation: the sum is s + c.
+		struct Acc {
+			double s = 0.0, c = 0.0;
+
+			void add(double x) {
+				auto t = s + x;
+				c += std::abs(s) >= std::abs(x) ? (s - t) + x : (x - t) + s;
+				s = t;
+			}
+			void add(const Acc& rhs) {
+				add(rhs.s);
+				c += rhs.c;
+			}
+			double value() const {
+				return s + c;
+			}
+		};
+
+		//Element k goes to lane k % LANES. The lanes are plain sums, which the
+		//compiler keeps in vector registers, and they are added with Neumaier.
+		template<class F>
+		Acc lanes(size_t n, const F& get) {
+			double lane[LANES] = {};
+			size_t k = 0;
+			for (; k + LANES <= n; k += LANES)
+				for (size_t l = 0; l < LANES; ++l)
+					lane[l] += get(k + l);
+			for (; k < n; ++k)
+				lane[k % LANES] += get(k);
+			Acc ans;
+			for (auto p : lane)
+				ans.add(p);
+			return ans;
+		}
+
+		//block(begin, end) sums the elements in [begin, end).
+		template<class F>
+		double reduce(size_t n, ThreadPool& pool, const F& block) {
+			size_t blocks = (n + BLOCK - 1) / BLOCK;
+			if (blocks <= 1)
+				return block(0, n).value();
+			std::vector<Acc> parts(blocks);
+			std::function<void(size_t)> fn = [&](size_t i) {
+				parts[i] = block(i * BLOCK, std::min(n, (i + 1) * BLOCK));
+			};
+			if (n >= PARALLEL)
+				pool.run(blocks, fn);
+			else
+				for (size_t i = 0; i < blocks; ++i)
+					fn(i);
+			for (size_t stride = 1; stride < blocks; stride <<= 1)
+				for (size_t i = 0; i + stride < blocks; i += 2 * stride)
+					parts[i].add(parts[i + stride]);
+			return parts[0].value();
+		}
+
+		//Calls fn(row, first column, count) for the rows in the flat range [begin, end).
+		template<class F>
+		void segments(const Matrix& x, size_t begin, size_t end, const F& fn) {
+			size_t w = x.shape.second;
+			while (begin < end) {
+				size_t i = begin / w, j = begin % w, len = std::min(w - j, end - begin);
+				fn(i, j, len);
+				begin += len;
+			}
+		}
+	}
+
+	double sum(const double* x, size_t n, ThreadPool& pool) {
+		return reduce(n, pool, [&](size_t begin, size_t end) {
+			auto p = x + begin;
+			return lanes(end - begin, [&](size_t k) { return p[k]; });
+		});
+	}
+
+	double dot(const double* a, const double* b, size_t n, ThreadPool& pool) {
+		return reduce(n, pool, [&](size_t begin, size_t end) {
+			auto p = a + begin, q = b + begin;
+			return lanes(end - begin, [&](size_t k) { return p[k] * q[k]; });
+		});
+	}
+
+	double sum(const std::vector<double>& x, ThreadPool& pool) {
+		return sum(x.data(), x.size(), pool);
+	}
+
+	double dot(const std::vector<double>& a, const std::vector<double>& b, ThreadPool& pool) {
+		assert(a.size() == b.size());
+		return dot(a.data(), b.data(), a.size(), pool);
+	}
+
+	double sum(const Matrix& x, ThreadPool& pool) {
+		return reduce(x.shape.first * x.shape.second, pool, [&](size_t begin, size_t end) {
+			Acc ans;
+			segments(x, begin, end, [&](size_t i, size_t j, size_t len) {
+				auto p = x.data[i].data() + j;
+				ans.add(lanes(len, [&](size_t k) { return p[k]; }));
+			});
+			return ans;
+		});
+	}
+
+	double mean(const Matrix& x, ThreadPool& pool) {
+		return sum(x, pool) / ((double)x.shape.first * (double)x.shape.second);
+	}
+
+	double dot(const Matrix& a, const Matrix& b, ThreadPool& pool) {
+		if (a.shape != b.shape)
+			throw "Bad input size!";
+		return reduce(a.shape.first * a.shape.second, pool, [&](size_t begin, size_t end) {
+			Acc ans;
+			segments(a, begin, end, [&](size_t i, size_t j, size_t len) {
+				auto p = a.data[i].data() + j, q = b.data[i].data() + j;
+				ans.add(lanes(len, [&](size_t k) { return p[k] * q[k]; }));
+			});
+			return ans;
+		});
+	}
+}
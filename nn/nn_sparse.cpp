@@ -0,0 +1,85 @@
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------SPARSE MATRIX------------------------------
+	SparseMatrix::SparseMatrix(size_t n_cols) {
+		shape = { 0, n_cols };
+	}
+
+	SparseMatrix::SparseMatrix(const Matrix& rhs) :SparseMatrix(rhs.shape.second) {
+		for (auto& p : rhs.data) {
+			for (size_t j = 0; j < p.size(); ++j)
+				if (p[j] != 0.0) {
+					col.push_back(j);
+					val.push_back(p[j]);
+				}
+			row_ptr.push_back(col.size());
+			++shape.first;
+		}
+	}
+
+	void SparseMatrix::add_row(const std::vector<std::pair<size_t, double>>& entries) {
+		for (auto& p : entries) {
+			assert(p.first < shape.second);
+			col.push_back(p.first);
+			val.push_back(p.second);
+		}
+		row_ptr.push_back(col.size());
+		++shape.first;
+	}
+
+	size_t SparseMatrix::nnz() const {
+		return val.size();
+	}
+
+	Matrix SparseMatrix::dense() const {
+		Matrix ans(shape.first, shape.second);
+		for (size_t i = 0; i < shape.first; ++i)
+			for (auto k = row_ptr[i]; k < row_ptr[i + 1]; ++k)
+				ans.data[i][col[k]] += val[k];
+		return ans;
+	}
+
+	Matrix SparseMatrix::matmul(const Matrix& rhs) const {
+		Matrix ans;
+		matmul(rhs, ans);
+		return ans;
+	}
+
+	void SparseMatrix::matmul(const Matrix& rhs, Matrix& out) const {
+		assert(shape.second == rhs.shape.first);
+		if (out.shape != std::make_pair(shape.first, rhs.shape.second) or out.data.size() != shape.first)
+			out = Matrix(shape.first, rhs.shape.second);
+		else
+			out.clear();
+		//Every nonzero adds one row of rhs.
+		for (size_t i = 0; i < shape.first; ++i) {
+			auto& out_row = out.data[i];
+			for (auto k = row_ptr[i]; k < row_ptr[i + 1]; ++k) {
+				auto a = val[k];
+				auto& rhs_row = rhs.data[col[k]];
+				for (size_t j = 0; j < rhs.shape.second; ++j)
+					out_row[j] += a * rhs_row[j];
+			}
+		}
+	}
+
+	void SparseMatrix::add_transpose_matmul(const Matrix& rhs, Matrix& out, std::vector<size_t>& rows) const {
+		assert(shape.first == rhs.shape.first);
+		assert(out.shape == std::make_pair(shape.second, rhs.shape.second));
+		for (size_t i = 0; i < shape.first; ++i) {
+			auto& rhs_row = rhs.data[i];
+			for (auto k = row_ptr[i]; k < row_ptr[i + 1]; ++k) {
+				auto a = val[k];
+				auto& out_row = out.data[col[k]];
+				for (size_t j = 0; j < rhs.shape.second; ++j)
+					out_row[j] += a * rhs_row[j];
+			}
+		}
+		rows.insert(rows.end(), col.begin(), col.end());
+	}
+}
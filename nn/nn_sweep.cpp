@@ -0,0 +1,174 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cassert>
+#include <memory>
+#include <string>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nn.h"
+
+namespace nn {
+	//-------------------------MAPPED DATASET-----------------------------
+	MappedDataset::MappedDataset(const std::string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw "Cannot open file!";
+		struct stat st;
+		if (::fstat(fd, &st) != 0 or size_t(st.st_size) < 2 * sizeof(uint64_t)) {
+			::close(fd);
+			throw "Bad dataset file!";
+		}
+		map_size = size_t(st.st_size);
+		map = ::mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED) {
+			map = nullptr;
+			throw "Cannot map file!";
+		}
+
+		auto header = static_cast<const uint64_t*>(map);
+		x_cols = size_t(header[0]), y_cols = size_t(header[1]);
+		size_t row_bytes = (x_cols + y_cols) * sizeof(double);
+		size_t body = map_size - 2 * sizeof(uint64_t);
+		if (row_bytes == 0 or body % row_bytes != 0) {
+			::munmap(map, map_size);
+			map = nullptr;
+			throw "Bad dataset file!";
+		}
+		n_rows = body / row_bytes;
+		values = reinterpret_cast<const double*>(header + 2);
+	}
+
+	MappedDataset::~MappedDataset() {
+		if (map)
+			::munmap(map, map_size);
+	}
+
+	void MappedDataset::save(const std::string& path, const Matrix& x, const Matrix& y) {
+		if (x.shape.first != y.shape.first)
+			throw "Bad input size!";
+		std::ofstream out(path, std::ios::binary);
+		if (not out)
+			throw "Cannot open file!";
+		uint64_t header[2] = { x.shape.second, y.shape.second };
+		out.write(reinterpret_cast<const char*>(header), sizeof(header));
+		for (size_t i = 0; i < x.shape.first; ++i) {
+			out.write(reinterpret_cast<const char*>(x.data[i].data()), x.shape.second * sizeof(double));
+			out.write(reinterpret_cast<const char*>(y.data[i].data()), y.shape.second * sizeof(double));
+		}
+		if (not out)
+			throw "Write error!";
+	}
+
+	size_t MappedDataset::size() const {
+		return n_rows;
+	}
+
+	std::pair<size_t, size_t> MappedDataset::features() const {
+		return { x_cols, y_cols };
+	}
+
+	void MappedDataset::batch(size_t begin, size_t n, Matrix& x, Matrix& y) const {
+		if (n_rows == 0)
+			throw "Empty dataset!";
+		if (x.shape != std::make_pair(n, x_cols) or x.data.size() != n)
+			x = Matrix(n, x_cols);
+		if (y.shape != std::make_pair(n, y_cols) or y.data.size() != n)
+			y = Matrix(n, y_cols);
+		for (size_t i = 0; i < n; ++i) {
+			auto row = values + ((begin + i) % n_rows) * (x_cols + y_cols);
+			std::copy(row, row + x_cols, x.data[i].begin());
+			std::copy(row + x_cols, row + x_cols + y_cols, y.data[i].begin());
+		}
+	}
+
+	//-------------------------SWEEP--------------------------------------
+	Sweep::Sweep(const MappedDataset& train, const MappedDataset& valid, size_t n_threads) :
+		train(train), valid(valid), pool(n_threads ? n_threads : 1) {
+		if (train.features() != valid.features())
+			throw "Bad input size!";
+	}
+
+	std::vector<Sweep::Result> Sweep::run(const std::vector<Trial>& trials, size_t first_steps, size_t rounds, std::ostream* metrics) {
+		struct State {
+			Var x, y, loss;
+			size_t offset = 0;
+		};
+		std::vector<State> states(trials.size());
+		std::vector<Result> results(trials.size());
+		std::vector<size_t> alive(trials.size());
+		//The models are built one by one, so build() does not need to be thread-safe.
+		for (size_t i = 0; i < trials.size(); ++i) {
+			alive[i] = i;
+			results[i].name = trials[i].name;
+			states[i].loss = trials[i].build(states[i].x, states[i].y);
+		}
+		if (metrics)
+			*metrics << "trial,round,steps,train_loss,valid_loss" << std::endl;
+
+		size_t steps = first_steps ? first_steps : 1, factor = eta > 1 ? eta : 2;
+		for (size_t round = 0; round < rounds and not alive.empty(); ++round) {
+			//Every trial is one job, and a free thread takes the next one, so long trials do not hold up the others.
+			pool.run(alive.size(), [&](size_t k) {
+				auto i = alive[k];
+				auto& st = states[i];
+				auto& r = results[i];
+
+				Matrix bx, by;
+				double sum = 0.0;
+				for (size_t s = 0; s < steps; ++s) {
+					train.batch(st.offset, batch_size, bx, by);
+					st.offset = (st.offset + batch_size) % train.size();
+					st.x.set_data(bx);
+					st.y.set_data(by);
+					st.loss.calculate();
+					st.loss.zero_grad();
+					st.loss.backward();
+					st.loss.optim(trials[i].optim, trials[i].LR);
+					sum += st.loss.graph_data().data.data[0][0];
+				}
+				r.steps += steps;
+				r.rounds = round + 1;
+				r.train_loss = sum / double(steps);
+
+				//The validation loss is the mean over all the rows, in batches.
+				//Evaluation mode keeps the rows out of the BatchNorm statistics.
+				double valid_sum = 0.0;
+				{
+					TrainModeGuard eval(st.loss, false);
+					for (size_t begin = 0; begin < valid.size(); begin += batch_size) {
+						auto n = std::min(batch_size, valid.size() - begin);
+						valid.batch(begin, n, bx, by);
+						st.x.set_data(bx);
+						st.y.set_data(by);
+						st.loss.calculate();
+						valid_sum += double(n) * st.loss.graph_data().data.data[0][0];
+					}
+				}
+				r.valid_loss = valid.size() ? valid_sum / double(valid.size()) : 0.0;
+				if (std::isnan(r.valid_loss))
+					r.valid_loss = std::numeric_limits<double>::infinity();
+			});
+
+			if (metrics)
+				for (auto i : alive)
+					*metrics << results[i].name << "," << round << "," << results[i].steps << ","
+					<< results[i].train_loss << "," << results[i].valid_loss << std::endl;
+
+			//Successive halving: the best 1 / eta of the trials go on, with eta times the steps.
+			//The last one left keeps training until the rounds are over.
+			std::stable_sort(alive.begin(), alive.end(), [&](size_t a, size_t b) {
+				return results[a].valid_loss < results[b].valid_loss;
+			});
+			alive.resize(std::max(size_t(1), alive.size() / factor));
+			steps *= factor;
+		}
+		return results;
+	}
+}
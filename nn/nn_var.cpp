@@ -3,11 +3,15 @@
 #include <assert.h>
 #include <memory>
 #include <random>
+#include <cmath>
+#include <algorithm>
 #include "nn.h"
 
 namespace nn {
 	//----------------------------VAR-----------------------------------
 	std::pair<size_t, size_t> Var::shape() const {
+		if (graph_ptr)
+			return graph_ptr->shape();
 		return data.shape;
 	}
 	void Var::print() const {
@@ -22,218 +26,196 @@ namespace nn {
 	}
 	Var::~Var() {}
 	Var::Var(int m, int n, bool init_random, double rand_mean, double rand_range) :data(m, n) {
-		if (init_random) {
-			std::default_random_engine e;
-			std::uniform_real_distribution<> n(-rand_mean - rand_range, rand_mean + rand_range);
-			for (auto& p : data.data)
-				for (auto& q : p)
-					q = n(e);
+		if (init_random)
+			init_weights(data, Init::uniform, rand_mean, rand_range);
+	}
+	Var::Var(const SparseMatrix& matrix) :sparse(std::make_shared<const SparseMatrix>(matrix)) {
+		data.shape = matrix.shape;
+		requires_grad = false;
+	}
+	namespace {
+		//Freed graph nodes of one size, kept for the next graph of this thread.
+		struct NodePool {
+			static constexpr size_t max_blocks = 4096;
+			std::vector<void*> blocks;
+			bool* alive;
+			~NodePool() {
+				*alive = false;
+				for (auto p : blocks)
+					::operator delete(p);
+			}
+		};
+		//Nullptr once the pool of this thread is destroyed.
+		template<size_t Size> NodePool* node_pool() {
+			thread_local bool alive = true;
+			thread_local NodePool pool{ {}, &alive };
+			return alive ? &pool : nullptr;
 		}
+
+		//Allocator for std::allocate_shared(), which puts the node and its control block in one pooled block.
+		template<class T> struct NodeAllocator {
+			using value_type = T;
+			NodeAllocator() = default;
+			template<class U> NodeAllocator(const NodeAllocator<U>&) {}
+			T* allocate(size_t n) {
+				auto pool = node_pool<sizeof(T)>();
+				if (n == 1 and pool and not pool->blocks.empty()) {
+					auto p = pool->blocks.back();
+					pool->blocks.pop_back();
+					return static_cast<T*>(p);
+				}
+				return static_cast<T*>(::operator new(n * sizeof(T)));
+			}
+			void deallocate(T* p, size_t n) {
+				auto pool = node_pool<sizeof(T)>();
+				if (n == 1 and pool and pool->blocks.size() < NodePool::max_blocks)
+					pool->blocks.push_back(p);
+				else
+					::operator delete(p);
+			}
+			template<class U> bool operator==(const NodeAllocator<U>&) const { return true; }
+			template<class U> bool operator!=(const NodeAllocator<U>&) const { return false; }
+		};
 	}
-	Var::Var(Var&& rhs) :Var(rhs) {
-		if (rhs.graph_ptr)
-			graph_ptr = rhs.graph_ptr;
-		else
-			graph_ptr = rhs.graph_ptr = std::make_shared<Var>(rhs);
+
+	const std::shared_ptr<Var>& Var::node() {
+		if (graph_ptr)
+			return graph_ptr;
+		graph_ptr = std::allocate_shared<Var>(NodeAllocator<Var>(), *this);
+		num1 = num2 = nullptr;
+		inputs.clear();
+		return graph_ptr;
+	}
+	Var::Var(Var&& rhs) {
+		graph_ptr = rhs.node();
 	}
 
 	Var Var::operator=(Var& rhs) {
-		if (rhs.graph_ptr)
-			graph_ptr = rhs.graph_ptr;
-		else
-			graph_ptr = rhs.graph_ptr = std::make_shared<Var>(rhs);
+		graph_ptr = rhs.node();
 		return rhs;
 	}
 	Var Var::operator=(Var&& rhs) {
-		if (rhs.graph_ptr)
-			graph_ptr = rhs.graph_ptr;
-		else
-			graph_ptr = rhs.graph_ptr = std::make_shared<Var>(rhs);
+		graph_ptr = rhs.node();
 		return rhs;
 	}
 	Var Var::operator+(Var& rhs) {
 		Var ans;
 		ans.op = plus;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::operator+(Var&& rhs) {
 		Var ans;
 		ans.op = plus;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::operator-(Var& rhs) {
 		Var ans;
 		ans.op = minus;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::operator-(Var&& rhs) {
 		Var ans;
 		ans.op = minus;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::operator*(Var& rhs) {
 		Var ans;
 		ans.op = times;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::operator*(Var&& rhs) {
 		Var ans;
 		ans.op = times;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::operator/(Var& rhs) {
 		Var ans;
 		ans.op = devides;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::operator/(Var&& rhs) {
 		Var ans;
 		ans.op = devides;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::matmul(Var& rhs) {
 		Var ans;
 		ans.op = mm;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 	Var Var::matmul(Var&& rhs) {
 		Var ans;
 		ans.op = mm;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
-		if (rhs.graph_ptr)
-			ans.num2 = rhs.graph_ptr;
-		else
-			rhs.graph_ptr = ans.num2 = std::make_shared<Var>(rhs);
+		ans.num1 = node();
+		ans.num2 = rhs.node();
 		return ans;
 	}
 
 	Var Var::relu() {
 		Var ans;
 		ans.op = re;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
+		ans.num1 = node();
 		return ans;
 	}
 	Var Var::tanh() {
 		Var ans;
 		ans.op = th;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
+		ans.num1 = node();
 		return ans;
 	}
 	Var Var::abs() {
 		Var ans;
 		ans.op = ab;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
+		ans.num1 = node();
 		return ans;
 	}
+	Var Var::embed(Var& indices) {
+		Var ans;
+		ans.op = emb;
+		ans.num1 = node();
+		//The indices have no grad, also when they are already on the graph.
+		indices.requires_grad = false;
+		ans.num2 = indices.node();
+		ans.num2->requires_grad = false;
+		return ans;
+	}
+	Var Var::embed(Var&& indices) {
+		return embed(indices);
+	}
 	Var Var::sigmoid() {
 		Var ans;
 		ans.op = sig;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
+		ans.num1 = node();
 		return ans;
 	}
 	Var Var::mean() {
 		Var ans;
 		ans.op = means_op;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
+		ans.num1 = node();
 		return ans;
 	}
 	Var Var::copy() {
 		Var ans;
 		ans.op = equals;
-		if (graph_ptr)
-			ans.num1 = graph_ptr;
-		else
-			graph_ptr = ans.num1 = std::make_shared<Var>(*this);
+		ans.num1 = node();
 		return ans;
 	}
 
@@ -248,93 +230,162 @@ namespace nn {
 		if (visited.find(this) != visited.end())
 			return;
 		visited.insert(this);
+		if (num1)
+			num1->cal(visited);
+		if (num2)
+			num2->cal(visited);
+		for (auto& p : inputs)
+			p->cal(visited);
+		if ((num1 and num1->sparse and op != mm and op != ones_like and op != ones_vector) or
+			(num2 and num2->sparse and op != from_double))
+			throw "Unsupported op!";
+		if (op == mm and num1->sparse)
+			num1->sparse->matmul(num2->data, data);
+		else if (conv_kernel)
+			conv_kernel->forward(op, num1->data, num2 ? &num2->data : nullptr, data);
+		else if (norm_kernel)
+			norm_kernel->forward(num1->data, num2->data, data);
+		else if (dropout_kernel)
+			dropout_kernel->forward(num1->data, data, dropout_mask);
+		else if (op == fused) {
+			std::vector<const Matrix*> in;
+			for (auto& p : inputs)
+				in.push_back(&p->data);
+			kernel->forward(in, data);
+		}
+		else if (op != none)
+			forward_kernel(op, op_num, num1 ? &num1->data : nullptr, num2 ? &num2->data : nullptr, data);
+
+		//Create grad Var.
+		if (requires_grad and (grad.empty() or grad.shape != data.shape)) {
+			grad = Matrix(data.shape.first, data.shape.second);
+			grad_rows.clear();
+			grad_dense = false;
+		}
+	}
+
+	namespace {
+		//Resize out only when its shape changes, so that its memory is reused.
+		void reshape(Matrix& out, size_t m, size_t n) {
+			if (out.shape != std::make_pair(m, n) or out.data.size() != m)
+				out = Matrix(m, n);
+		}
+
+		template<class F>
+		void map1(const Matrix& a, Matrix& out, F f) {
+			reshape(out, a.shape.first, a.shape.second);
+			for (size_t i = 0; i < a.shape.first; ++i)
+				for (size_t j = 0; j < a.shape.second; ++j)
+					out.data[i][j] = f(a.data[i][j]);
+		}
+
+		template<class F>
+		void map2(const Matrix& a, const Matrix& b, Matrix& out, F f) {
+			assert(a.shape == b.shape);
+			reshape(out, a.shape.first, a.shape.second);
+			for (size_t i = 0; i < a.shape.first; ++i)
+				for (size_t j = 0; j < a.shape.second; ++j)
+					out.data[i][j] = f(a.data[i][j], b.data[i][j]);
+		}
+	}
+
+	void Var::forward_kernel(Var_op op, double op_num, const Matrix* a, const Matrix* b, Matrix& out) {
 		switch (op)
 		{
 		case nn::Var::none:
 			break;
 		case nn::Var::equals:
-			num1->cal(visited);
-			data = num1->data;
+			out = *a;
 			break;
 		case nn::Var::plus:
-			num1->cal(visited);
-			num2->cal(visited);
-			data = num1->data + num2->data;
+			map2(*a, *b, out, [](double x, double y) { return x + y; });
 			break;
 		case nn::Var::minus:
-			num1->cal(visited);
-			num2->cal(visited);
-			data = num1->data - num2->data;
+			map2(*a, *b, out, [](double x, double y) { return x - y; });
 			break;
 		case nn::Var::times:
-			num1->cal(visited);
-			num2->cal(visited);
-			data = num1->data * num2->data;
+			map2(*a, *b, out, [](double x, double y) { return x * y; });
 			break;
 		case nn::Var::devides:
-			num1->cal(visited);
-			num2->cal(visited);
-			data = num1->data / num2->data;
+			map2(*a, *b, out, [](double x, double y) { return x / y; });
 			break;
 		case nn::Var::mm:
-			num1->cal(visited);
-			num2->cal(visited);
-			data = num1->data.matmul(num2->data);
+			a->matmul(*b, out);
 			break;
 		case nn::Var::re:
-			num1->cal(visited);
-			data = num1->data.relu();
+			map1(*a, out, [](double x) { return x > 0 ? x : 0; });
 			break;
 		case nn::Var::th:
-			num1->cal(visited);
-			data = Matrix(num1->shape().first, num1->shape().second);
-			for (size_t i = 0; i < num1->shape().first; ++i)
-				for (size_t j = 0; j < num1->shape().second; ++j)
-					data.data[i][j] = ::tanh(num1->data.data[i][j]);
+			map1(*a, out, [](double x) { return std::tanh(x); });
 			break;
 		case nn::Var::sig:
-			num1->cal(visited);
-			data = Matrix(num1->shape().first, num1->shape().second);
-			for (size_t i = 0; i < num1->shape().first; ++i)
-				for (size_t j = 0; j < num1->shape().second; ++j)
-					data.data[i][j] = 1.0 / (1.0 + ::pow(2.718281828459, -num1->data.data[i][j]));
+			map1(*a, out, [](double x) { return 1.0 / (1.0 + ::pow(2.718281828459, -x)); });
 			break;
 		case nn::Var::ab:
-			num1->cal(visited);
-			data = Matrix(num1->shape().first, num1->shape().second);
-			for (size_t i = 0; i < num1->shape().first; ++i)
-				for (size_t j = 0; j < num1->shape().second; ++j)
-					data.data[i][j] = ::abs(num1->data.data[i][j]);
+			map1(*a, out, [](double x) { return std::abs(x); });
 			break;
 		case nn::Var::from_double:
-			num2->cal(visited);
-			data = Matrix(num2->shape().first, num2->shape().second, op_num);
+			reshape(out, b->shape.first, b->shape.second);
+			for (auto& p : out.data)
+				for (auto& q : p)
+					q = op_num;
 			break;
-		case nn::Var::means_op: {
-			num1->cal(visited);
-			double mean_val = 0.0;
-			for (auto p : num1->data.data)
-				for (auto q : p)
-					mean_val += q;
-			mean_val /= (double)num1->data.shape.first * (double)num1->data.shape.second;
-			data = Matrix(1, 1, mean_val);
-		}
+		case nn::Var::means_op:
+			reshape(out, 1, 1);
+			out.data[0][0] = nn::mean(*a);
 			break;
 		case nn::Var::ones_like:
-			num1->cal(visited);
-			data = Matrix(std::vector<std::vector<double>>(num1->shape().first, std::vector<double>(num1->shape().first, 1.0)));
+			reshape(out, a->shape.first, a->shape.second);
+			for (auto& p : out.data)
+				for (auto& q : p)
+					q = 1.0;
 			break;
 		case nn::Var::ones_vector:
-			num1->cal(visited);
-			data = Matrix(std::vector<std::vector<double>>(num1->shape().first, std::vector<double>(1, 1.0)));
+			reshape(out, a->shape.first, 1);
+			for (auto& p : out.data)
+				p[0] = 1.0;
+			break;
+		case nn::Var::emb: {
+			size_t d = a->shape.second, l = b->shape.second;
+			reshape(out, b->shape.first, l * d);
+			for (size_t i = 0; i < b->shape.first; ++i)
+				for (size_t k = 0; k < l; ++k) {
+					auto r = size_t(b->data[i][k]);
+					if (b->data[i][k] < 0 or r >= a->shape.first)
+						throw "Index out of range!";
+					std::copy(a->data[r].begin(), a->data[r].end(), out.data[i].begin() + k * d);
+				}
+		}
+			break;
+		case nn::Var::softmax_ce: {
+			if (b->shape.first != a->shape.first or (b->shape.second != 1 and b->shape.second != a->shape.second))
+				throw "Bad label size!";
+			std::vector<double> row_loss(a->shape.first, 0.0);
+			for (size_t i = 0; i < a->shape.first; ++i) {
+				//log(sum(exp(x))) = max + log(sum(exp(x - max))), so nothing overflows.
+				auto& x = a->data[i];
+				auto& y = b->data[i];
+				auto max_x = *std::max_element(x.begin(), x.end());
+				double sum = 0.0;
+				for (auto q : x)
+					sum += std::exp(q - max_x);
+				auto lse = max_x + std::log(sum);
+				if (b->shape.second == 1) {
+					if (y[0] < 0 or size_t(y[0]) >= x.size())
+						throw "Index out of range!";
+					row_loss[i] = lse - x[size_t(y[0])];
+				}
+				else
+					for (size_t j = 0; j < x.size(); ++j)
+						row_loss[i] += y[j] * (lse - x[j]);
+			}
+			reshape(out, 1, 1);
+			out.data[0][0] = nn::sum(row_loss) / double(a->shape.first);
+		}
 			break;
 		default:
 			break;
 		}
-
-		//Create grad Var.
-		if (requires_grad and (grad.empty() or grad.shape != data.shape))
-			grad = Matrix(data.shape.first, data.shape.second);
 	}
 
 	Var Var::graph() const {
@@ -351,19 +402,56 @@ namespace nn {
 			return graph_ptr->graph_data();
 	}
 	void Var::set_data(const Matrix& rhs) {
-		graph_data().data = rhs;
+		auto& p = graph_data();
+		p.data = rhs;
+		p.sparse = nullptr;
 	}
 	void Var::set_data(const Var& rhs) {
-		graph_data().data = rhs._data();
+		if (rhs.graph_ptr)
+			set_data(*rhs.graph_ptr);
+		else if (rhs.sparse)
+			set_data(*rhs.sparse);
+		else
+			set_data(rhs.data.view());
+	}
+	void Var::set_data(const SparseMatrix& rhs) {
+		auto& p = graph_data();
+		p.data = Matrix();
+		p.data.shape = rhs.shape;
+		p.sparse = std::make_shared<const SparseMatrix>(rhs);
+	}
+
+	void Var::set_data(const MatrixView& rhs) {
+		auto& p = graph_data();
+		rhs.copy_to(p.data);
+		p.sparse = nullptr;
 	}
 
 	Matrix Var::_data() const {
-		return graph().data;
+		if (graph_ptr)
+			return graph_ptr->_data();
+		return data;
 	}
 	Matrix Var::_grad() const {
-		return graph().grad;
+		if (graph_ptr)
+			return graph_ptr->_grad();
+		return grad;
+	}
+	MatrixView Var::data_view() const {
+		if (graph_ptr)
+			return graph_ptr->data_view();
+		if (sparse)
+			throw "Sparse data has no view!";
+		return data;
+	}
+	MatrixView Var::grad_view() const {
+		if (graph_ptr)
+			return graph_ptr->grad_view();
+		return grad;
 	}
 	bool Var::empty() const {
+		if (graph_ptr)
+			return graph_ptr->empty();
 		return data.empty();
 	}
 }